@@ -0,0 +1,338 @@
+/* bench_pubsub.c: Benchmark Message Queue Clients against a Broker
+ *
+ * Publishers each open their own message queue and publish messages of the
+ * given size round-robin across the topics, while subscribers each open a
+ * message queue subscribed to every topic and retrieve messages until they
+ * have received every one that was published.  Each message body begins with
+ * the time it was published, so subscribers can record the publish-to-delivery
+ * latency.  Results are written as one JSON object per run.
+ */
+
+#include "mq/client.h"
+#include "mq/histogram.h"
+#include "mq/string.h"
+
+#include <stdbool.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TIMESTAMP   20      // Digits of timestamp at start of each message
+#define RETRIEVE    64      // Messages retrieved per request
+
+/* Structures */
+
+typedef struct Options Options;
+struct Options {
+    const char *host;
+    const char *port;
+    size_t  publishers;
+    size_t  subscribers;
+    size_t  topics;
+    size_t  messages;       // Messages published by each publisher
+    size_t  size;           // Bytes per message body
+    size_t  batch;          // Messages per publish request (1 for unbatched)
+    size_t  timeout;        // Seconds to wait for delivery
+    bool    async;          // Publish asynchronously (counting acknowledgements)
+    bool    handles;        // Publish through topic handles (unbatched only)
+    MessageQueueOptions mq;
+};
+
+typedef struct Worker Worker;
+struct Worker {
+    Thread          thread;
+    MessageQueue *  mq;
+    Options *       options;
+    size_t          messages;   // Messages published or delivered
+    uint64_t        last;       // Time of last delivery (subscribers only)
+    Histogram       latency;    // Publish-to-delivery latency in nanoseconds (subscribers only)
+};
+
+/* Globals */
+
+static size_t Finished = 0;     // Subscribers that have received every message
+static size_t Acked    = 0;     // Asynchronous publishes acknowledged with 200
+
+/* Functions */
+
+/**
+ * Count successful acknowledgements of asynchronous publishes.
+ */
+void bench_ack(MessageQueue *mq, const MessageQueueAck *acks, size_t n, void *arg) {
+    size_t acked = 0;
+    for (size_t a = 0; a < n; a++)
+        acked += acks[a].status == 200;
+    __atomic_fetch_add(&Acked, acked, __ATOMIC_RELAXED);
+}
+
+/**
+ * Create and start message queue subscribed to every topic, waiting until the
+ * broker has processed the subscriptions (by round-tripping a message through
+ * a topic private to the queue).
+ */
+MessageQueue *subscriber_create(Options *options, const char *name) {
+    char topic[BUFSIZ];
+
+    MessageQueue *mq = mq_create_with_options(name, options->host, options->port, &options->mq);
+    if (!mq)
+        return NULL;
+
+    for (size_t t = 0; t < options->topics; t++) {
+        sprintf(topic, "bench%lu", t);
+        mq_subscribe(mq, topic);
+    }
+    mq_subscribe(mq, name);
+    mq_publish(mq, name, "ready");
+    mq_start(mq);
+
+    char *ready = mq_retrieve(mq);
+    if (!ready || !streq(ready, "ready")) {
+        error("Unable to subscribe %s", name);
+        exit(EXIT_FAILURE);
+    }
+    free(ready);
+    mq_unsubscribe(mq, name);
+    return mq;
+}
+
+/**
+ * Unsubscribe message queue from every topic and stop it.
+ */
+void subscriber_stop(Options *options, MessageQueue *mq) {
+    char topic[BUFSIZ];
+
+    for (size_t t = 0; t < options->topics; t++) {
+        sprintf(topic, "bench%lu", t);
+        mq_unsubscribe(mq, topic);
+    }
+    mq_stop(mq);
+}
+
+/* Threads */
+
+void *publisher(void *arg) {
+    Worker *     w = (Worker *)arg;
+    Options *    o = w->options;
+    char *       bodies = malloc(o->batch * (o->size + 1));
+    const char **batch  = malloc(o->batch * sizeof(char *));
+    char         topic[BUFSIZ];
+    MessageQueueTopic **handles = calloc(o->topics, sizeof(MessageQueueTopic *));
+
+    for (size_t t = 0; o->handles && t < o->topics; t++) {
+        sprintf(topic, "bench%lu", t);
+        handles[t] = mq_topic_open(w->mq, topic);
+    }
+
+    for (size_t b = 0; b < o->batch; b++) {
+        batch[b] = bodies + b * (o->size + 1);
+        memset(bodies + b * (o->size + 1), '.', o->size);
+        bodies[b * (o->size + 1) + o->size] = 0;
+    }
+
+    for (size_t m = 0; m < w->messages; ) {
+        size_t n = o->batch < w->messages - m ? o->batch : w->messages - m;
+
+        sprintf(topic, "bench%lu", (m / o->batch) % o->topics);
+        for (size_t b = 0; b < n; b++) {
+            char *body = (char *)batch[b];
+            snprintf(body, TIMESTAMP + 1, "%0*lu", TIMESTAMP, histogram_timestamp());
+            body[TIMESTAMP] = '.';
+        }
+
+        if (o->handles && o->batch == 1)
+            mq_publish_h(handles[(m / o->batch) % o->topics], batch[0], o->size);
+        else if (o->async && o->batch > 1)
+            mq_publish_batch_async(w->mq, topic, batch, n);
+        else if (o->async)
+            mq_publish_async(w->mq, topic, batch[0]);
+        else if (o->batch > 1)
+            mq_publish_batch(w->mq, topic, batch, n);
+        else
+            mq_publish(w->mq, topic, batch[0]);
+        m += n;
+    }
+
+    free(handles);
+    free(batch);
+    free(bodies);
+    return NULL;
+}
+
+void *subscriber(void *arg) {
+    Worker * w = (Worker *)arg;
+    Options *o = w->options;
+    size_t   expected = o->publishers * o->messages;
+    char *   messages[RETRIEVE];
+
+    while (w->messages < expected && !mq_shutdown(w->mq)) {
+        size_t n = mq_retrieve_many(w->mq, RETRIEVE, messages);
+
+        w->last = histogram_timestamp();
+        for (size_t m = 0; m < n; m++) {
+            histogram_record(&w->latency, w->last - strtoull(messages[m], NULL, 10));
+            free(messages[m]);
+        }
+        w->messages += n;
+    }
+
+    if (w->messages >= expected)
+        __atomic_fetch_add(&Finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Main execution */
+
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options] HOST PORT\n\n", progname);
+    fprintf(stderr, "HOST may be unix:/path or unix:@name to connect over a Unix domain socket (PORT is ignored).\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -p PUBLISHERS   Number of publishers (default: 1)\n");
+    fprintf(stderr, "    -s SUBSCRIBERS  Number of subscribers (default: 1)\n");
+    fprintf(stderr, "    -t TOPICS       Number of topics (default: 1)\n");
+    fprintf(stderr, "    -n MESSAGES     Messages per publisher (default: 65536)\n");
+    fprintf(stderr, "    -m SIZE         Bytes per message (default: 64, minimum: %d)\n", TIMESTAMP + 1);
+    fprintf(stderr, "    -b BATCH        Messages per publish request (default: 1)\n");
+    fprintf(stderr, "    -w TIMEOUT      Seconds to wait for delivery (default: 60)\n");
+    fprintf(stderr, "    -r              Use shared reactor instead of pusher/puller threads\n");
+    fprintf(stderr, "    -c CONNECTIONS  Shard publishes across connections (default: 0 for one shared connection)\n");
+    fprintf(stderr, "    -S              Stream messages to subscribers instead of retrieving them\n");
+    fprintf(stderr, "    -a              Publish asynchronously and count acknowledgements\n");
+    fprintf(stderr, "    -P WINDOW       Prefetch up to WINDOW messages ahead of retrievals (default: 0)\n");
+    fprintf(stderr, "    -H              Publish through topic handles (unbatched publishes only)\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    Options options = {
+        .publishers  = 1,
+        .subscribers = 1,
+        .topics      = 1,
+        .messages    = 1<<16,
+        .size        = 64,
+        .batch       = 1,
+        .timeout     = 60,
+    };
+
+    /* Parse command-line arguments */
+    int c;
+    while ((c = getopt(argc, argv, "p:s:t:n:m:b:w:rc:SaP:Hh")) != -1) {
+        switch (c) {
+            case 'p': options.publishers  = strtoul(optarg, NULL, 10); break;
+            case 's': options.subscribers = strtoul(optarg, NULL, 10); break;
+            case 't': options.topics      = strtoul(optarg, NULL, 10); break;
+            case 'n': options.messages    = strtoul(optarg, NULL, 10); break;
+            case 'm': options.size        = strtoul(optarg, NULL, 10); break;
+            case 'b': options.batch       = strtoul(optarg, NULL, 10); break;
+            case 'w': options.timeout     = strtoul(optarg, NULL, 10); break;
+            case 'r': options.mq.reactor  = true; break;
+            case 'c': options.mq.connections = strtoul(optarg, NULL, 10); break;
+            case 'S': options.mq.stream   = true; break;
+            case 'a': options.async       = true; break;
+            case 'P': options.mq.prefetch = strtoul(optarg, NULL, 10); break;
+            case 'H': options.handles     = true; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS);
+            default:  usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 2 || !options.publishers || !options.subscribers || !options.topics ||
+        !options.batch || options.size <= TIMESTAMP)
+        usage(argv[0], EXIT_FAILURE);
+
+    if (options.async)
+        options.mq.ack_handler = bench_ack;
+
+    options.host = argv[optind];
+    options.port = argv[optind + 1];
+
+    Worker * publishers  = calloc(options.publishers, sizeof(Worker));
+    Worker * subscribers = calloc(options.subscribers, sizeof(Worker));
+    if (!publishers || !subscribers) {
+        error("Unable to allocate benchmark");
+        return EXIT_FAILURE;
+    }
+
+    /* Connect subscribers and publishers */
+    char name[BUFSIZ];
+    for (size_t i = 0; i < options.subscribers; i++) {
+        sprintf(name, "bench_%d_sub%lu", getpid(), i);
+        subscribers[i].mq      = subscriber_create(&options, name);
+        subscribers[i].options = &options;
+        histogram_init(&subscribers[i].latency);
+        if (!subscribers[i].mq) {
+            error("Unable to connect to %s:%s", options.host, options.port);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < options.publishers; i++) {
+        sprintf(name, "bench_%d_pub%lu", getpid(), i);
+        publishers[i].mq       = mq_create_with_options(name, options.host, options.port, &options.mq);
+        publishers[i].options  = &options;
+        publishers[i].messages = options.messages;
+        if (!publishers[i].mq) {
+            error("Unable to connect to %s:%s", options.host, options.port);
+            return EXIT_FAILURE;
+        }
+        mq_start(publishers[i].mq);
+    }
+
+    /* Run publishers and subscribers */
+    uint64_t start = histogram_timestamp();
+
+    for (size_t i = 0; i < options.subscribers; i++)
+        thread_create(&subscribers[i].thread, NULL, subscriber, &subscribers[i]);
+    for (size_t i = 0; i < options.publishers; i++)
+        thread_create(&publishers[i].thread, NULL, publisher, &publishers[i]);
+    for (size_t i = 0; i < options.publishers; i++)
+        thread_join(publishers[i].thread, NULL);
+
+    /* Wait for delivery (stopping subscribers early unblocks their retrievals) */
+    uint64_t deadline = start + options.timeout * 1000000000ULL;
+    while (__atomic_load_n(&Finished, __ATOMIC_ACQUIRE) < options.subscribers &&
+           histogram_timestamp() < deadline)
+        usleep(1000);
+
+    for (size_t i = 0; i < options.subscribers; i++)
+        subscriber_stop(&options, subscribers[i].mq);
+
+    Histogram latency;
+    histogram_init(&latency);
+    uint64_t last      = start;
+    size_t   delivered = 0;
+    for (size_t i = 0; i < options.subscribers; i++) {
+        thread_join(subscribers[i].thread, NULL);
+        histogram_merge(&latency, &subscribers[i].latency);
+        delivered += subscribers[i].messages;
+        if (subscribers[i].last > last)
+            last = subscribers[i].last;
+        mq_delete(subscribers[i].mq);
+    }
+
+    for (size_t i = 0; i < options.publishers; i++) {
+        mq_stop(publishers[i].mq);
+        mq_delete(publishers[i].mq);
+    }
+
+    double seconds = (last - start) / 1e9;
+    size_t expected = options.subscribers * options.publishers * options.messages;
+
+    /* Report results */
+    printf("{\"benchmark\": \"pubsub\", \"io\": \"%s\", \"connections\": %lu, \"stream\": %s, \"async\": %s, \"prefetch\": %lu, \"handles\": %s, \"publishers\": %lu, \"subscribers\": %lu, "
+           "\"topics\": %lu, \"messages\": %lu, \"size\": %lu, \"batch\": %lu, "
+           "\"published\": %lu, \"acked\": %lu, \"delivered\": %lu, \"seconds\": %.6f, "
+           "\"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f, \"latency_ns\": ",
+           options.mq.reactor ? "reactor" : "threads", options.mq.connections, options.mq.stream ? "true" : "false", options.async ? "true" : "false", options.mq.prefetch, options.handles ? "true" : "false", options.publishers, options.subscribers,
+           options.topics, options.messages, options.size, options.batch,
+           options.publishers * options.messages, __atomic_load_n(&Acked, __ATOMIC_RELAXED), delivered, seconds,
+           seconds > 0 ? delivered / seconds : 0.0,
+           seconds > 0 ? delivered * options.size / seconds : 0.0);
+    histogram_write(&latency, stdout);
+    printf("}\n");
+
+    free(publishers);
+    free(subscribers);
+    return delivered == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
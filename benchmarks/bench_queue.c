@@ -0,0 +1,180 @@
+/* bench_queue.c: Benchmark Concurrent Queue of Requests
+ *
+ * Producers create requests with payloads of the given size and push them
+ * through a single queue to consumers, which pop and delete them.  Each
+ * payload begins with the time it was pushed, so consumers can record the
+ * push-to-pop latency.  Results are written as one JSON object per run.
+ */
+
+#include "mq/histogram.h"
+#include "mq/logging.h"
+#include "mq/queue.h"
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <unistd.h>
+
+/* Structures */
+
+typedef struct Options Options;
+struct Options {
+    size_t  producers;
+    size_t  consumers;
+    size_t  messages;       // Total messages pushed by all producers
+    size_t  payload;        // Bytes per message body
+    size_t  burst;          // Messages pushed between pauses (0 for no pauses)
+    size_t  gap;            // Microseconds to pause between bursts
+    size_t  ring;           // Ring capacity (0 for linked list)
+};
+
+typedef struct Worker Worker;
+struct Worker {
+    Thread      thread;
+    Queue *     queue;
+    Options *   options;
+    size_t      messages;   // Messages to push (producers only)
+    Histogram   latency;    // Push-to-pop latency in nanoseconds (consumers only)
+};
+
+/* Threads */
+
+void *producer(void *arg) {
+    Worker * w = (Worker *)arg;
+    char *   body = calloc(1, w->options->payload);
+
+    for (size_t m = 0; m < w->messages; m++) {
+        if (w->options->burst && m && m % w->options->burst == 0)
+            usleep(w->options->gap);
+
+        uint64_t now = histogram_timestamp();
+        memcpy(body, &now, sizeof(now));
+        queue_push(w->queue, request_create_body("PUT", "/topic/bench", body, w->options->payload));
+    }
+
+    free(body);
+    return NULL;
+}
+
+void *consumer(void *arg) {
+    Worker * w = (Worker *)arg;
+
+    while (true) {
+        Request *r = queue_pop(w->queue);
+        if (!r->body) {
+            request_delete(r);
+            break;
+        }
+
+        uint64_t then;
+        memcpy(&then, r->body, sizeof(then));
+        histogram_record(&w->latency, histogram_timestamp() - then);
+        request_delete(r);
+    }
+
+    return NULL;
+}
+
+/* Main execution */
+
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options]\n\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -p PRODUCERS    Number of producer threads (default: 1)\n");
+    fprintf(stderr, "    -c CONSUMERS    Number of consumer threads (default: 1)\n");
+    fprintf(stderr, "    -n MESSAGES     Total number of messages (default: 1048576)\n");
+    fprintf(stderr, "    -s PAYLOAD      Bytes per message (default: 64, minimum: 8)\n");
+    fprintf(stderr, "    -b BURST        Messages per burst (default: 0 = steady)\n");
+    fprintf(stderr, "    -g GAP          Microseconds between bursts (default: 100)\n");
+    fprintf(stderr, "    -r CAPACITY     Use ring buffer queue of capacity (default: 0 = list)\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    Options options = {
+        .producers = 1,
+        .consumers = 1,
+        .messages  = 1<<20,
+        .payload   = 64,
+        .burst     = 0,
+        .gap       = 100,
+        .ring      = 0,
+    };
+
+    /* Parse command-line arguments */
+    int c;
+    while ((c = getopt(argc, argv, "p:c:n:s:b:g:r:h")) != -1) {
+        switch (c) {
+            case 'p': options.producers = strtoul(optarg, NULL, 10); break;
+            case 'c': options.consumers = strtoul(optarg, NULL, 10); break;
+            case 'n': options.messages  = strtoul(optarg, NULL, 10); break;
+            case 's': options.payload   = strtoul(optarg, NULL, 10); break;
+            case 'b': options.burst     = strtoul(optarg, NULL, 10); break;
+            case 'g': options.gap       = strtoul(optarg, NULL, 10); break;
+            case 'r': options.ring      = strtoul(optarg, NULL, 10); break;
+            case 'h': usage(argv[0], EXIT_SUCCESS);
+            default:  usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (!options.producers || !options.consumers || options.payload < sizeof(uint64_t))
+        usage(argv[0], EXIT_FAILURE);
+
+    Queue *  q         = options.ring ? queue_create_ring(options.ring) : queue_create();
+    Worker * producers = calloc(options.producers, sizeof(Worker));
+    Worker * consumers = calloc(options.consumers, sizeof(Worker));
+    if (!q || !producers || !consumers) {
+        error("Unable to allocate benchmark");
+        return EXIT_FAILURE;
+    }
+
+    /* Run producers and consumers */
+    uint64_t start = histogram_timestamp();
+
+    for (size_t i = 0; i < options.consumers; i++) {
+        consumers[i].queue   = q;
+        consumers[i].options = &options;
+        histogram_init(&consumers[i].latency);
+        thread_create(&consumers[i].thread, NULL, consumer, &consumers[i]);
+    }
+
+    for (size_t i = 0; i < options.producers; i++) {
+        producers[i].queue    = q;
+        producers[i].options  = &options;
+        producers[i].messages = options.messages / options.producers
+                              + (i < options.messages % options.producers);
+        thread_create(&producers[i].thread, NULL, producer, &producers[i]);
+    }
+
+    for (size_t i = 0; i < options.producers; i++)
+        thread_join(producers[i].thread, NULL);
+
+    /* Stop consumers once everything else has been popped */
+    for (size_t i = 0; i < options.consumers; i++)
+        queue_push(q, request_create_body("STOP", NULL, NULL, 0));
+
+    Histogram latency;
+    histogram_init(&latency);
+    for (size_t i = 0; i < options.consumers; i++) {
+        thread_join(consumers[i].thread, NULL);
+        histogram_merge(&latency, &consumers[i].latency);
+    }
+
+    double seconds = (histogram_timestamp() - start) / 1e9;
+
+    /* Report results */
+    printf("{\"benchmark\": \"queue\", \"queue\": \"%s\", \"producers\": %lu, \"consumers\": %lu, "
+           "\"messages\": %lu, \"payload\": %lu, \"burst\": %lu, \"gap_us\": %lu, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"latency_ns\": ",
+           options.ring ? "ring" : "list", options.producers, options.consumers,
+           options.messages, options.payload, options.burst, options.gap,
+           seconds, latency.count / seconds);
+    histogram_write(&latency, stdout);
+    printf("}\n");
+
+    queue_delete(q);
+    free(producers);
+    free(consumers);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
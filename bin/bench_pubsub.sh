@@ -0,0 +1,53 @@
+#!/bin/bash
+# bench_pubsub.sh: Sweep pub/sub benchmark configurations against a local broker (one JSON object per line)
+
+BENCHMARK=bin/bench_pubsub
+SERVER=${SERVER:-bin/mq_server}
+MESSAGES=${MESSAGES:-16384}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-0}
+    kill $SERVERPID
+    exit $STATUS
+}
+
+for program in $BENCHMARK $SERVER; do
+    if [ ! -x $program ]; then
+	echo "Failure: $program is not executable!" 1>&2
+	exit 1
+    fi
+done
+
+PORT=$(find_port)
+
+./$SERVER --port=$PORT > /dev/null 2>&1 &
+SERVERPID=$!
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+while ! ss -H4tln | awk '{print $4}' | grep -q ":$PORT\$"; do
+    sleep 0.1
+done
+
+for io in "" "-r" "-S" "-r -S" "-a" "-r -a" "-P 256" "-r -P 256" "-H" "-r -H"; do
+    for connections in 0 4; do
+	for clients in "1 1" "4 1" "1 4" "4 4"; do
+	    set -- $clients
+	    for size in 64 4096; do
+		for batch in 1 64; do
+		    $BENCHMARK $io -c $connections -p $1 -s $2 -t 4 -n $MESSAGES -m $size -b $batch localhost $PORT 2> /dev/null | grep '^{'
+		done
+	    done
+	done
+    done
+done
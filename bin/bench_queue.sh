@@ -0,0 +1,21 @@
+#!/bin/bash
+# bench_queue.sh: Sweep queue benchmark configurations (one JSON object per line)
+
+BENCHMARK=bin/bench_queue
+MESSAGES=${MESSAGES:-262144}
+
+if [ ! -x $BENCHMARK ]; then
+    echo "Failure: $BENCHMARK is not executable!" 1>&2
+    exit 1
+fi
+
+for queue in 0 1024; do
+    for threads in "1 1" "4 1" "1 4" "4 4"; do
+	set -- $threads
+	for payload in 16 1024; do
+	    for burst in 0 64; do
+		$BENCHMARK -p $1 -c $2 -n $MESSAGES -s $payload -b $burst -r $queue 2> /dev/null | grep '^{'
+	    done
+	done
+    done
+done
@@ -5,8 +5,11 @@
 This Message Queue Server supports the following REST API:
 
     PUT     /topic/$topic               Publish message to $topic.
+    PUT     /topic/$topic?batch=$n      Publish $n length-prefixed messages to $topic.
 
     GET     /queue/$queue               Retrieve one message from $queue.
+    GET     /queue/$queue?max=$n        Retrieve up to $n length-prefixed messages from $queue.
+    GET     /stream/$queue              Stream length-prefixed messages from $queue as chunks.
 
     PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
@@ -20,6 +23,10 @@ import sys
 import time
 
 import tornado.gen
+import tornado.httpserver
+import tornado.iostream
+import tornado.locks
+import tornado.netutil
 import tornado.options
 import tornado.web
 
@@ -37,17 +44,95 @@ class BaseHandler(tornado.web.RequestHandler):
         self.application.logger.info(message.rstrip())
         self.write(message)
 
+# Frames
+
+def unframe(body, count):
+    ''' Split batch body into messages, each framed as: Length($MESSAGE)\n$MESSAGE '''
+    messages = []
+    offset   = 0
+
+    while offset < len(body):
+        newline = body.index(b'\n', offset)
+        length  = body[offset:newline]
+        if not length.isdigit() or newline + 1 + int(length) > len(body):
+            raise ValueError
+        offset = newline + 1 + int(length)
+        messages.append(body[newline + 1:offset])
+
+    if not messages or len(messages) != count:
+        raise ValueError
+    return messages
+
+def frame(messages):
+    ''' Join messages into batch body, each framed as: Length($MESSAGE)\n$MESSAGE '''
+    return b''.join(str(len(m)).encode() + b'\n' + m for m in messages)
+
+# Inbox
+
+class Inbox(object):
+    ''' Messages stored for one queue: a deque (so appending and retrieving
+    are O(1)) bounded by number of messages and total bytes.  A full inbox
+    either drops its oldest messages to make room or rejects new ones. '''
+
+    def __init__(self, max_messages=0, max_bytes=0, overflow='drop'):
+        self.messages     = collections.deque()
+        self.bytes        = 0
+        self.max_messages = max_messages
+        self.max_bytes    = max_bytes
+        self.overflow     = overflow
+
+    def __len__(self):
+        return len(self.messages)
+
+    def __iter__(self):
+        return iter(self.messages)
+
+    def full(self, message):
+        return (self.max_messages and len(self.messages) >= self.max_messages) or \
+               (self.max_bytes and self.bytes and self.bytes + len(message) > self.max_bytes)
+
+    def append(self, message):
+        ''' Store message (returning whether or not it was stored). '''
+        while self.full(message):
+            if self.overflow == 'reject':
+                return False
+            self.bytes -= len(self.messages.popleft())
+
+        self.messages.append(message)
+        self.bytes += len(message)
+        return True
+
+    def extend(self, messages):
+        ''' Store messages (returning how many were stored). '''
+        return sum(self.append(m) for m in messages)
+
+    def popleft(self):
+        message     = self.messages.popleft()
+        self.bytes -= len(message)
+        return message
+
+    def popmany(self, maximum):
+        return [self.popleft() for _ in range(min(maximum, len(self.messages)))]
+
+    def clear(self):
+        self.messages.clear()
+        self.bytes = 0
+
 # Topic Handler
 
 class TopicHandler(BaseHandler):
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
+        if self.get_query_argument('batch', None) is not None:
+            return self.put_batch(topic, self.get_query_argument('batch'))
+
         message     = self.request.body
+        queues      = self.application.subscribers.get(topic, ())
         subscribers = 0
 
-        for queue, topics in self.application.subscriptions.items():
-            if topic in topics:
-                self.application.queues[queue].append(message)
+        for queue in queues:
+            if self.application.queues[queue].append(message):
+                self.application.waiters[queue].notify()
                 subscribers += 1
 
         if subscribers:
@@ -56,6 +141,36 @@ class TopicHandler(BaseHandler):
                 subscribers,
                 topic,
             ))
+        elif queues:
+            raise tornado.web.HTTPError(503, 'Every queue subscribed to topic is full: {}'.format(topic))
+        else:
+            raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
+
+    def put_batch(self, topic, count):
+        ''' Publish batch of messages (length-prefixed frames of request body)
+        to each queue that is subscribed to topic. '''
+        try:
+            messages = unframe(self.request.body, int(count))
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid batch of {} messages for topic: {}'.format(count, topic))
+
+        queues      = self.application.subscribers.get(topic, ())
+        subscribers = 0
+        for queue in queues:
+            stored = self.application.queues[queue].extend(messages)
+            if stored:
+                self.application.waiters[queue].notify(stored)
+                subscribers += 1
+
+        if subscribers:
+            self.write('Published {} messages ({} bytes) to {} subscribers of {}\n'.format(
+                len(messages),
+                sum(map(len, messages)),
+                subscribers,
+                topic,
+            ))
+        elif queues:
+            raise tornado.web.HTTPError(503, 'Every queue subscribed to topic is full: {}'.format(topic))
         else:
             raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
 
@@ -64,19 +179,73 @@ class TopicHandler(BaseHandler):
 class QueueHandler(BaseHandler):
     @tornado.gen.coroutine
     def get(self, queue):
-        ''' Retrieve one message from queue (wait until one is available). '''
+        ''' Retrieve one message (or a framed batch of up to max messages) from
+        queue (wait until one is available). '''
 
         if queue not in self.application.queues:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(1)
-
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].pop(0))
+        try:
+            maximum = int(self.get_query_argument('max', 0))
+            if maximum < 0 or (self.get_query_argument('max', None) is not None and not maximum):
+                raise ValueError
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid maximum number of messages for queue: {}'.format(queue))
+
+        messages = self.application.queues[queue]
+        waiters  = self.application.waiters[queue]
+        while not messages and not self.request.connection.stream.closed():
+            self.waiter = waiters.wait()
+            yield self.waiter
+
+        if messages and maximum:
+            self.write(frame(messages.popmany(maximum)))
+        elif messages:
+            self.write_response(messages.popleft())
         else:
+            # Pass on any wakeup meant for this (now closed) connection
+            waiters.notify()
             raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
 
+    def on_connection_close(self):
+        ''' Stop waiting for messages once the client has gone away. '''
+        waiter = getattr(self, 'waiter', None)
+        if waiter and not waiter.done():
+            waiter.set_result(False)
+
+# Stream Handler
+
+class StreamHandler(QueueHandler):
+    @tornado.gen.coroutine
+    def get(self, queue):
+        ''' Stream messages from queue (creating it if it does not exist) as
+        chunks of length-prefixed frames for as long as the client stays
+        connected.  Chunks are framed here (rather than by tornado) so that
+        HTTP/1.0 clients receive them too. '''
+
+        messages = self.application.queues[queue]
+        waiters  = self.application.waiters[queue]
+
+        self.set_header('Transfer-Encoding', 'chunked')
+        yield self.flush()
+
+        while not self.request.connection.stream.closed():
+            if not messages:
+                self.waiter = waiters.wait()
+                yield self.waiter
+                continue
+
+            batch = frame(messages)
+            messages.clear()
+            self.write('{:x}\r\n'.format(len(batch)).encode() + batch + b'\r\n')
+            try:
+                yield self.flush()
+            except tornado.iostream.StreamClosedError:
+                break
+
+        # Pass on any wakeup meant for this (now closed) connection
+        waiters.notify()
+
 # Subscription Handler
 
 class SubscriptionHandler(BaseHandler):
@@ -84,6 +253,7 @@ class SubscriptionHandler(BaseHandler):
         ''' Subscribe queue to topic. '''
         try:
             self.application.subscriptions[queue].add(topic)
+            self.application.subscribers[topic].add(queue)
             if queue not in self.application.queues:
                 self.application.queues[queue]
         except KeyError:
@@ -98,6 +268,11 @@ class SubscriptionHandler(BaseHandler):
         except KeyError:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
+        subscribers = self.application.subscribers[topic]
+        subscribers.discard(queue)
+        if not subscribers:
+            del self.application.subscribers[topic]
+
         self.write_response('Unsubscribed queue ({}) from topic ({})\n'.format(queue, topic))
 
 # Message Queue
@@ -113,18 +288,42 @@ class MessageQueue(tornado.web.Application):
         self.address       = settings.get('address', self.DEFAULT_ADDRESS)
         self.port          = settings.get('port'   , self.DEFAULT_PORT)
         self.ioloop        = tornado.ioloop.IOLoop.instance()
-        self.queues        = collections.defaultdict(list)
-        self.subscriptions = collections.defaultdict(set)
+        self.max_messages  = settings.get('max_messages', 0)
+        self.max_bytes     = settings.get('max_bytes', 0)
+        self.overflow      = settings.get('overflow', 'drop')
+        self.queues        = collections.defaultdict(
+            lambda: Inbox(self.max_messages, self.max_bytes, self.overflow)
+        )
+        self.subscriptions = collections.defaultdict(set)    # queue -> topics
+        self.subscribers   = collections.defaultdict(set)    # topic -> queues
+        self.waiters       = collections.defaultdict(tornado.locks.Condition)
 
         self.add_handlers('.*', (
             ('.*/topic/(.*)'            , TopicHandler),
             ('.*/queue/(.*)'            , QueueHandler),
+            ('.*/stream/(.*)'           , StreamHandler),
             ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
         ))
 
+    def bind_unix(self, path):
+        ''' Bind Unix domain socket: /path in the filesystem or @name in the
+        abstract namespace '''
+        if not path.startswith('@'):
+            return tornado.netutil.bind_unix_socket(path)
+
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.setblocking(False)
+        sock.bind('\0' + path[1:])
+        sock.listen(128)
+        return sock
+
     def run(self):
         try:
-            self.listen(self.port, self.address)
+            if self.address.startswith('unix:'):
+                server = tornado.httpserver.HTTPServer(self)
+                server.add_socket(self.bind_unix(self.address[len('unix:'):]))
+            else:
+                self.listen(self.port, self.address)
         except socket.error as e:
             self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
             sys.exit(1)
@@ -135,8 +334,11 @@ class MessageQueue(tornado.web.Application):
 
 if __name__ == '__main__':
     tornado.options.define('debug'  , default=False, help='Enable debugging mode')
-    tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
+    tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on (unix:/path or unix:@name for a Unix domain socket).')
     tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
+    tornado.options.define('max_messages', default=0, help='Most messages stored per queue (0 for unlimited).')
+    tornado.options.define('max_bytes'   , default=0, help='Most message bytes stored per queue (0 for unlimited).')
+    tornado.options.define('overflow'    , default='drop', help='What a full queue does: drop (oldest) or reject.')
     tornado.options.parse_command_line()
 
     signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
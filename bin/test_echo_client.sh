@@ -21,7 +21,7 @@ find_port() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
-    kill $SERVERPID
+    kill $SERVERPID $UNIXPID $ABSTRACTPID
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -41,12 +41,58 @@ fi
 
 PORT=$(find_port)
 
-./bin/mq_server.py --port=$PORT > /dev/null 2>&1 &
+./bin/mq_server --port=$PORT > /dev/null 2>&1 &
 SERVERPID=$!
 
+while ! ss -H4tln | awk '{print $4}' | grep -q ":$PORT\$"; do
+    sleep 0.1
+done
+
 valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT &> $WORKSPACE/test
 if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
     error "Failure"
 else
     echo "Success"
 fi
+
+printf "%-40s ... " "Testing $FUNCTIONAL (reactor)"
+valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT reactor &> $WORKSPACE/test
+if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+for mode in pool reactor-pool stream reactor-stream consume reactor-stream-consume prefetch reactor-prefetch prefetch-consume ring reactor-ring; do
+    printf "%-40s ... " "Testing $FUNCTIONAL ($mode)"
+    valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT $mode &> $WORKSPACE/test
+    if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+done
+
+SOCKET=$WORKSPACE/mq.sock
+ABSTRACT=@$FUNCTIONAL.$$
+
+./bin/mq_server --address=unix:$SOCKET > /dev/null 2>&1 &
+UNIXPID=$!
+./bin/mq_server --address=unix:$ABSTRACT > /dev/null 2>&1 &
+ABSTRACTPID=$!
+
+while [ ! -S $SOCKET ] || ! ss -Hxl | grep -q "$ABSTRACT"; do
+    sleep 0.1
+done
+
+for endpoint in unix:$SOCKET unix:$ABSTRACT; do
+    for mode in threads reactor; do
+	printf "%-40s ... " "Testing $FUNCTIONAL (${endpoint:0:6} $mode)"
+	valgrind --leak-check=full bin/$FUNCTIONAL $endpoint 0 $mode &> $WORKSPACE/test
+	if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+	    error "Failure"
+	else
+	    echo "Success"
+	fi
+    done
+done
@@ -51,6 +51,80 @@ class ServerTestCase(unittest.TestCase):
 
         self.test_00_publish_without_subscribers()
 
+    def test_07_publish_batch(self):
+        self.test_02_subscribe()
+
+        messages = ['one', 'two', self.BODY]
+        batch    = ''.join('{}\n{}'.format(len(m), m) for m in messages)
+        r = requests.put(self.URL + '/topic/_topic?batch=3', data=batch)
+        self.assertEqual(r.status_code  , 200)
+        self.assertEqual(
+            r.text.rstrip(),
+            'Published 3 messages ({} bytes) to 1 subscribers of _topic'.format(sum(map(len, messages))),
+        )
+
+        for message in messages:
+            r = requests.get(self.URL + '/queue/_queue')
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.text       , message)
+
+        r = requests.put(self.URL + '/topic/_topic?batch=2', data=batch)
+        self.assertEqual(r.status_code, 400)
+
+        self.test_06_unsubscribe()
+
+    def test_08_retrieve_batch(self):
+        self.test_02_subscribe()
+
+        messages = ['one', 'two', self.BODY]
+        batch    = ''.join('{}\n{}'.format(len(m), m) for m in messages)
+        r = requests.put(self.URL + '/topic/_topic?batch=3', data=batch)
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_queue?max=2')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.text       , '3\none3\ntwo')
+
+        r = requests.get(self.URL + '/queue/_queue?max=8')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.text       , batch[len('3\none3\ntwo'):])
+
+        r = requests.get(self.URL + '/queue/_queue?max=0')
+        self.assertEqual(r.status_code, 400)
+
+        self.test_06_unsubscribe()
+
+    def test_09_publish_binary(self):
+        self.test_02_subscribe()
+
+        body = b'NUL\x00bytes\x00'
+        r = requests.put(self.URL + '/topic/_topic', data=body)
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_queue')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.content    , body)
+
+        self.test_06_unsubscribe()
+
+    def test_10_retrieve_while_streaming(self):
+        self.test_02_subscribe()
+
+        with requests.get(self.URL + '/stream/_queue', stream=True, timeout=2) as stream:
+            self.assertEqual(stream.status_code, 200)
+
+            r = requests.get(self.URL + '/queue/_queue', timeout=2)
+            self.assertEqual(r.status_code  , 409)
+            self.assertEqual(r.text.rstrip(), 'Queue is being streamed: _queue')
+
+            r = requests.get(self.URL + '/stream/_queue', timeout=2)
+            self.assertEqual(r.status_code, 409)
+
+        # Once the stream is closed, retrievals are served again
+        self.test_03_publish()
+        self.test_04_retrieve()
+        self.test_06_unsubscribe()
+
 # Main execution
 
 if __name__ == '__main__':
@@ -0,0 +1,58 @@
+#!/bin/bash
+
+FUNCTIONAL=test_stop_client
+WORKSPACE=/tmp/$FUNCTIONAL.$(id -u)
+FAILURES=0
+
+error() {
+    echo "$@"
+    [ -r $WORKSPACE/test ] && (echo; cat $WORKSPACE/test; echo)
+    FAILURES=$((FAILURES + 1))
+}
+
+find_port() {
+    for port in $(seq 9000 9999); do
+    	if ! ss -H4tlpn | awk '{print $4}' | cut -d : -f 2 | grep -q $port; then
+    	    echo $port
+    	    break
+	fi
+    done
+}
+
+cleanup() {
+    STATUS=${1:-$FAILURES}
+    kill $SERVERPID
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+mkdir $WORKSPACE
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+echo
+
+if [ ! -x bin/$FUNCTIONAL ]; then
+    echo "Failure: bin/$FUNCTIONAL is not executable!"
+    exit 1
+fi
+
+PORT=$(find_port)
+
+./bin/mq_server --port=$PORT > /dev/null 2>&1 &
+SERVERPID=$!
+
+while ! ss -H4tln | awk '{print $4}' | grep -q ":$PORT\$"; do
+    sleep 0.1
+done
+
+for mode in threads reactor pool reactor-pool ring reactor-ring prefetch ring-prefetch reactor-ring-prefetch; do
+    printf "%-40s ... " "Testing $FUNCTIONAL ($mode)"
+    valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT $mode &> $WORKSPACE/test
+    if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+done
@@ -0,0 +1,40 @@
+/* buffer.h: Growable byte buffer */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Structures */
+
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *  data;
+    size_t  start;      // Offset of first unconsumed byte
+    size_t  end;        // Offset one past last valid byte
+    size_t  capacity;
+};
+
+/* Macros */
+
+#define buffer_head(b)      ((b)->data + (b)->start)
+#define buffer_length(b)    ((b)->end - (b)->start)
+
+/* Functions */
+
+void        buffer_init(Buffer *b);
+void        buffer_free(Buffer *b);
+
+bool        buffer_reserve(Buffer *b, size_t n);
+bool        buffer_append(Buffer *b, const void *data, size_t n);
+bool        buffer_printf(Buffer *b, const char *format, ...);
+void        buffer_consume(Buffer *b, size_t n);
+
+ssize_t     buffer_read(Buffer *b, int fd);
+ssize_t     buffer_write(Buffer *b, int fd);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,37 +3,178 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/buffer.h"
+#include "mq/histogram.h"
+#include "mq/http.h"
 #include "mq/queue.h"
 #include "thread.h"
 
 #include <netdb.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Structures */
 
 typedef struct MessageQueue MessageQueue;
+
+typedef struct MessageQueueAck MessageQueueAck;
+struct MessageQueueAck {
+    uint64_t  ticket;		// Ticket returned by mq_publish_async
+    int       status;		// Status of broker's response (0 if the request was never answered)
+};
+
+/* Called on the I/O thread with every acknowledgement parsed from one read (so
+ * it must not block; in reactor mode it delays every attached message queue) */
+typedef void (*MessageQueueAckHandler)(MessageQueue *mq, const MessageQueueAck *acks, size_t n, void *arg);
+
+/* Called on a worker thread with each consumed message (concurrently with the
+ * other workers; the message is freed once the handler returns) */
+typedef void (*MessageQueueHandler)(MessageQueue *mq, const char *message, void *arg);
+
+typedef struct MessageQueueConsumer MessageQueueConsumer;
+
+typedef struct MessageQueueOptions MessageQueueOptions;
+struct MessageQueueOptions {
+    size_t  ring_capacity;	// Use lock-free rings of this capacity for outgoing queues (0 = linked lists;
+    				// the retriever's stays a linked list when prefetching)
+    bool    reactor;		// Share one epoll I/O thread among message queues (instead of pusher/puller)
+
+    size_t  max_outgoing;	// Most requests waiting to be sent (0 = unbounded; linked lists only)
+    size_t  max_outgoing_bytes;	// Most message bytes waiting to be sent (0 = unbounded; linked lists only)
+    QueuePolicy outgoing_policy; // What publishing does when outgoing is full (default: QUEUE_BLOCK;
+    				// QUEUE_DROP_OLDEST cannot be combined with ack_handler)
+
+    size_t  connections;	// Connections publishes are sharded across by topic, plus one
+    				// dedicated to retrieves (0 = one connection for everything)
+    bool    stream;		// Receive messages over one streaming response (on a dedicated
+    				// connection) instead of sending a GET per retrieval
+
+    MessageQueueAckHandler ack_handler; // Called with batches of mq_publish_async acknowledgements
+    void *  ack_arg;		// Passed to ack_handler
+
+    size_t  prefetch;		// Messages requested ahead of retrievals (0 = one request per
+    				// retrieval; ignored when streaming)
+};
+
+typedef enum {
+    MQ_REQUEST_PUBLISH,		// PUT /topic/$topic
+    MQ_REQUEST_RETRIEVE,	// GET /queue/$queue
+    MQ_REQUEST_SUBSCRIPTION,	// PUT or DELETE /subscription/$queue/$topic
+    MQ_REQUEST_TYPES,
+} MessageQueueRequestType;
+
+typedef struct MessageQueueStats MessageQueueStats;
+struct MessageQueueStats {
+    uint64_t  published;		// Messages published
+    uint64_t  published_bytes;	// Bytes of message bodies published
+    uint64_t  retrieved;		// Messages retrieved
+    uint64_t  retrieved_bytes;	// Bytes of message bodies retrieved
+
+    size_t    outgoing;		// Requests waiting to be sent
+    size_t    incoming;		// Responses waiting to be retrieved
+    size_t    pending;		// Requests sent awaiting a response
+
+    size_t    outgoing_bytes;	// Bytes of message bodies waiting to be sent
+    size_t    outgoing_peak;	// Most requests ever waiting to be sent (summed over connections)
+    size_t    outgoing_peak_bytes;	// Most bytes of message bodies ever waiting to be sent (summed over connections)
+    size_t    dropped;		// Publish requests discarded by QUEUE_DROP_OLDEST
+    size_t    rejected;		// Publish requests refused by QUEUE_FAIL
+
+    uint64_t  acked;		// Asynchronous publishes acknowledged (whatever their status)
+
+    uint64_t  responses[MQ_REQUEST_TYPES];	// Responses received (by request type)
+    uint64_t  errors[MQ_REQUEST_TYPES];		// Non-200 responses received (by request type)
+    Histogram rtt[MQ_REQUEST_TYPES];		// Round-trip time in nanoseconds (by request type)
+};
+
+typedef struct MessageQueueConnection MessageQueueConnection;
+struct MessageQueueConnection {
+    MessageQueue *mq;		// Message queue that owns connection
+
+    Queue*  outgoing;		// Requests to be sent to server
+    Queue*  pending;		// Requests sent to server awaiting a response (in order)
+
+    Thread  pusher, puller;
+    int     fd;			// Socket connected to server
+    Buffer  rbuffer;		// Bytes received from server but not yet parsed
+    HTTPParser parser;		// Response parser state
+    bool    streaming;		// Chunks of a streaming response are being received
+
+    int     efd;		// Eventfd signalled when outgoing becomes non-empty (reactor)
+    Buffer  wbuffer;		// Bytes waiting to be sent to server (reactor)
+    uint32_t events;		// Events socket is registered for (reactor)
+    bool    stopping;		// Sentinel has been taken from outgoing (reactor)
+    bool    halfclosed;		// Socket has been shut down for writing (reactor)
+    MessageQueueConnection *dnext; // Next connection being detached (reactor)
+
+    MessageQueueAck *acks;	// Acknowledgements waiting to be delivered (NULL without ack_handler)
+    size_t  nacks;		// Number of acknowledgements waiting to be delivered
+
+    uint64_t  acked;				// Asynchronous publishes acknowledged on connection
+    uint64_t  responses[MQ_REQUEST_TYPES];	// Responses received on connection (by request type)
+    uint64_t  errors[MQ_REQUEST_TYPES];		// Non-200 responses received on connection (by request type)
+    Histogram rtt[MQ_REQUEST_TYPES];		// Round-trip time on connection (by request type)
+};
+
+typedef struct MessageQueueTopic MessageQueueTopic;
+struct MessageQueueTopic {
+    MessageQueue *mq;		// Message queue that owns topic
+    MessageQueueConnection *connection; // Connection publishes to topic are sent on
+    char *  name;		// Name of topic
+    char *  uri;		// /topic/$name
+    char *  prefix;		// Header of publishes up to the Content-Length value
+    size_t  plength;		// Length of prefix
+    MessageQueueTopic *next;	// Next topic opened on message queue
+};
+
 struct MessageQueue {
     char    name[NI_MAXHOST];	// Name of message queue
     char    host[NI_MAXHOST];	// Host of server
     char    port[NI_MAXSERV];	// Port of server
 
-    Queue*  outgoing;		// Requests to be sent to server
-    Queue*  incoming;		// Requests received from server
+    MessageQueueConnection *connections; // Publishes are sharded by topic across all but the last
+    size_t  nconnections;	// Number of connections (1 if everything shares one connection)
+    MessageQueueConnection *retriever;	 // Connection retrieves are sent on
+
+    Queue*  incoming;		// Requests received from server (always a linked list, so routing never blocks)
+    bool    stream;		// Whether or not messages arrive over a stream (on retriever)
+    size_t  prefetch;		// Most messages requested or waiting in incoming (0 = no prefetching)
+    size_t  credit;		// Messages that may still be requested (prefetching)
     bool    shutdown;		// Whether or not to shutdown
+    Mutex   sd_lock;
+
+    bool    reactor;		// Whether or not I/O is performed by the shared reactor
+    size_t  detached;		// Connections that have stopped receiving responses
+    Cond    sd_cond;		// Signalled as connections stop
 
-    Thread pusher, puller;
-    FILE * fs;
-    // TODO: Add any necessary thread and synchronization primitives
-    Mutex sd_lock;
-    Mutex fs_lock;
-    Cond retv_cond;
+    MessageQueueAckHandler ack_handler; // Called with batches of acknowledgements (may be NULL)
+    void *  ack_arg;		// Passed to ack_handler
+    uint64_t tickets;		// Last ticket handed out by mq_publish_async
+
+    MessageQueueConsumer *consumer; // Worker pool started by mq_consume (NULL if none)
+
+    MessageQueueTopic *topics;	// Topics opened by mq_topic_open (freed by mq_delete)
+    Mutex   t_lock;		// Protects topics
+
+    MessageQueueStats stats;	// Publish and retrieve counters (updated atomically; response
+				// counters are kept per connection and merged by mq_stats)
 };
 
 MessageQueue *	mq_create(const char *name, const char *host, const char *port);
+MessageQueue *	mq_create_with_options(const char *name, const char *host, const char *port,
+                                       const MessageQueueOptions *options);
 void		mq_delete(MessageQueue *mq);
 
-void		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+bool		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+bool		mq_publish_batch(MessageQueue *mq, const char *topic, const char **bodies, size_t n);
+uint64_t	mq_publish_async(MessageQueue *mq, const char *topic, const char *body);
+uint64_t	mq_publish_batch_async(MessageQueue *mq, const char *topic, const char **bodies, size_t n);
+
+MessageQueueTopic *mq_topic_open(MessageQueue *mq, const char *topic);
+bool		mq_publish_h(MessageQueueTopic *t, const char *body, size_t length);
 char *		mq_retrieve(MessageQueue *mq);
+size_t		mq_retrieve_many(MessageQueue *mq, size_t max, char **messages);
+bool		mq_consume(MessageQueue *mq, MessageQueueHandler handler, void *arg, size_t nworkers);
 
 void		mq_subscribe(MessageQueue *mq, const char *topic);
 void		mq_unsubscribe(MessageQueue *mq, const char *topic);
@@ -42,6 +183,7 @@ void		mq_start(MessageQueue *mq);
 void		mq_stop(MessageQueue *mq);
 
 bool		mq_shutdown(MessageQueue *mq);
+void		mq_stats(MessageQueue *mq, MessageQueueStats *stats);
 
 #endif
 
@@ -0,0 +1,40 @@
+/* histogram.h: Log-linear latency histogram */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define HISTOGRAM_SUBBITS   4   // Sub-buckets per power of two = 2^SUBBITS (~6% precision)
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUBBITS + 1) << HISTOGRAM_SUBBITS)
+
+/* Structures */
+
+typedef struct Histogram Histogram;
+struct Histogram {
+    uint64_t    counts[HISTOGRAM_BUCKETS];
+    uint64_t    count;      // Number of recorded values
+    uint64_t    sum;
+    uint64_t    min;
+    uint64_t    max;
+};
+
+/* Functions */
+
+void        histogram_init(Histogram *h);
+void        histogram_record(Histogram *h, uint64_t value);
+void        histogram_merge(Histogram *dst, const Histogram *src);
+void        histogram_snapshot(Histogram *dst, const Histogram *src);
+
+uint64_t    histogram_percentile(const Histogram *h, double percentile);
+double      histogram_mean(const Histogram *h);
+void        histogram_write(const Histogram *h, FILE *fs);
+
+uint64_t    histogram_timestamp();
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
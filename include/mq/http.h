@@ -0,0 +1,51 @@
+/* http.h: HTTP message parsing and formatting */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "mq/buffer.h"
+#include "mq/request.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Constants */
+
+#define HTTP_HEADER_MAX     (1<<14)     // Largest header block accepted
+#define HTTP_BODY_MAX       (1<<26)     // Largest request body accepted
+
+#define HTTP_TOO_LARGE      (-2)        // Parse result for a message over one of the limits
+
+#define HTTP_KEEPALIVE      (1<<0)      // Connection should stay open
+#define HTTP_VERSION_11     (1<<1)      // Message used HTTP/1.1
+#define HTTP_CHUNKED        (1<<2)      // Body follows as chunks (responses only)
+
+/* Structures */
+
+typedef struct HTTPParser HTTPParser;
+struct HTTPParser {
+    size_t  scanned;    // Bytes already searched for end of header block
+};
+
+/* Functions */
+
+void        http_parser_init(HTTPParser *p);
+
+ssize_t     http_parse_request(HTTPParser *p, const char *data, size_t length, Request **request, int *flags);
+ssize_t     http_parse_response(HTTPParser *p, const char *data, size_t length, Request **response, int *flags);
+
+const char *http_reason(int status);
+bool        http_write_response(Buffer *b, int status, const char *body, size_t length, int flags);
+bool        http_write_stream(Buffer *b);
+
+bool        http_chunk_begin(Buffer *b, size_t length);
+bool        http_chunk_end(Buffer *b);
+ssize_t     http_chunk_next(const char *data, size_t length, const char **chunk, size_t *clength);
+
+bool        http_frame_append(Buffer *b, const char *data, size_t length);
+size_t      http_frame_length(size_t length);
+ssize_t     http_frame_next(const char *data, size_t length, const char **frame, size_t *flength);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -9,18 +9,49 @@
 
 #include <pthread.h>
 
+/* Constants */
+
+#define LOG_LEVEL_DEBUG   0
+#define LOG_LEVEL_INFO    1
+#define LOG_LEVEL_ERROR   2
+#define LOG_LEVEL_NONE    3
+
+/* Messages below LOG_LEVEL are compiled out (e.g. -DLOG_LEVEL=LOG_LEVEL_ERROR) */
+#ifndef LOG_LEVEL
 #ifndef NDEBUG
+#define LOG_LEVEL   LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL   LOG_LEVEL_INFO
+#endif
+#endif
+
+/* Functions */
+
+void    log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void    log_flush();
+
+/* Macros */
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
 #define debug(M, ...) \
-    fprintf(stderr, "[%09lu] DEBUG %s:%d:%s: " M "\n", pthread_self(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+    log_write(LOG_LEVEL_DEBUG, "%s:%d:%s: " M, __FILE__, __LINE__, __func__, ##__VA_ARGS__)
 #else
 #define debug(M, ...)
 #endif
 
+#if LOG_LEVEL <= LOG_LEVEL_INFO
 #define info(M, ...) \
-    fprintf(stderr, "[%09lu] INFO  " M "\n", pthread_self(), ##__VA_ARGS__)
+    log_write(LOG_LEVEL_INFO, M, ##__VA_ARGS__)
+#else
+#define info(M, ...)
+#endif
 
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
 #define error(M, ...) \
-    fprintf(stderr, "[%09lu] ERROR " M "\n", pthread_self(), ##__VA_ARGS__)
+    log_write(LOG_LEVEL_ERROR, M, ##__VA_ARGS__)
+#else
+#define error(M, ...)
+#endif
 
 #endif
 
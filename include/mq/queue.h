@@ -6,26 +6,56 @@
 #include "mq/request.h"
 #include "mq/thread.h"
 
+#include <time.h>
+
 /* Structures */
 
+typedef enum {
+    QUEUE_BLOCK,	// Block pusher until there is room
+    QUEUE_FAIL,		// Reject request (queue_push returns false)
+    QUEUE_DROP_OLDEST,	// Delete oldest requests with bodies to make room
+} QueuePolicy;
+
+typedef struct QueueRing QueueRing;
+
 typedef struct Queue Queue;
 struct Queue {
     Request *head;
     Request *tail;
     size_t   size;
 
-    // TODO: Add any necessary thread and synchronization primitives
-    Mutex lock;
-    Cond notempty;
+    Mutex lock;		// Protects linked list (and its counters)
+    Cond notempty;	// Signalled when requests are pushed
+    Cond notfull;	// Signalled when requests are popped from a full queue
+
+    QueueRing *ring;	// Lock-free ring buffer (NULL for linked list)
+    int notify;		// Eventfd written to when queue becomes non-empty (-1 for none)
+
+    size_t   bytes;		// Total length of request bodies (linked list only)
+    size_t   max_size;		// Most requests admitted by queue_push (0 for unbounded)
+    size_t   max_bytes;		// Most body bytes admitted by queue_push (0 for unbounded)
+    QueuePolicy policy;		// What queue_push does when a limit would be exceeded
+    size_t   peak_size;		// High-water mark of size
+    size_t   peak_bytes;	// High-water mark of bytes
+    size_t   dropped;		// Requests deleted by QUEUE_DROP_OLDEST
+    size_t   rejected;		// Requests refused by QUEUE_FAIL
 };
 
 /* Functions */
 
 Queue *	    queue_create();
+Queue *	    queue_create_ring(size_t capacity);
+Queue *	    queue_create_bounded(size_t max_size, size_t max_bytes, QueuePolicy policy);
 void        queue_delete(Queue *q);
 
-void	    queue_push(Queue *q, Request *r);
+bool	    queue_push(Queue *q, Request *r);
+void	    queue_push_all(Queue *q, Request *head);
 Request *   queue_pop(Queue *q);
+size_t      queue_pop_batch(Queue *q, Request **requests, size_t max);
+Request *   queue_pop_all(Queue *q);
+Request *   queue_pop_timed(Queue *q, const struct timespec *deadline);
+Request *   queue_try_pop(Queue *q);
+Request *   queue_try_pop_all(Queue *q);
 
 #endif
 
@@ -3,7 +3,12 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include "mq/buffer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 /* Structures */
 
@@ -12,15 +17,32 @@ struct Request {
     char *	method;
     char *	uri;
     char *	body;
-    
+
     Request *	next;
+
+    size_t      length;     // Length of body
+    size_t      capacity;   // Size of inline storage (method, uri, and body follow structure)
+    uint64_t    timestamp;  // Time request was sent (nanoseconds, 0 if not sent)
+    uint64_t    ticket;     // Publish ticket to acknowledge when answered (0 if none)
+
+    const char *prefix;     // Persistent header up to the Content-Length value (see request_prefix; NULL to format it)
+    size_t      plength;    // Length of prefix
 };
 
+/* Macros */
+
+/* Length of body (requests not made by request_create may not record it) */
+#define request_length(r)   ((r)->length || !(r)->body ? (r)->length : strlen((r)->body))
+
 /* Functions */
 
 Request *   request_create(const char *method, const char *uri, const char *body);
+Request *   request_create_body(const char *method, const char *uri, const char *body, size_t length);
 void	    request_delete(Request *r);
+bool        request_format(Request *r, Buffer *b, bool persistent);
+char *      request_prefix(const char *method, const char *uri, size_t *length);
 void        request_write(Request *r, FILE *fs);
+bool        request_send(Request **requests, size_t n, Buffer *headers, int fd);
 
 #endif
 
@@ -4,10 +4,21 @@
 #define SOCKET_H
 
 #include <stdio.h>
+#include <string.h>
+
+/* Constants */
+
+#define SOCKET_UNIX     "unix:"     // Host prefix of Unix domain socket endpoints (port is ignored)
+
+/* Macros */
+
+/* Whether host names a Unix domain socket: unix:/path (filesystem) or unix:@name (abstract) */
+#define socket_is_unix(host)    ((host) && strncmp((host), SOCKET_UNIX, sizeof(SOCKET_UNIX) - 1) == 0)
 
 /* Functions */
 
-FILE *  socket_connect(const char *host, const char *port);
+int     socket_connect(const char *host, const char *port);
+int     socket_listen(const char *host, const char *port);
 
 #endif
 
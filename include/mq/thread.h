@@ -39,6 +39,7 @@ typedef pthread_cond_t              Cond;
 #define cond_init(c, a)             PTHREAD_CHECK(pthread_cond_init(c, a))
 #define cond_wait(c, l)             PTHREAD_CHECK(pthread_cond_wait(c, l))
 #define cond_signal(c)              PTHREAD_CHECK(pthread_cond_signal(c))
+#define cond_broadcast(c)           PTHREAD_CHECK(pthread_cond_broadcast(c))
 #define cond_destroy(c)             PTHREAD_CHECK(pthread_cond_destroy(c))
 
 #endif
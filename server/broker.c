@@ -0,0 +1,760 @@
+/* broker.c: Native Message Queue Broker (topics, queues, and subscriptions) */
+
+#define _GNU_SOURCE
+
+#include "broker.h"
+
+#include "mq/logging.h"
+#include "mq/string.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define BROKER_BUCKETS  (1<<6)
+#define BROKER_STREAM   (1<<20)     // Bytes a stream may buffer before messages stay queued
+#define BROKER_CHUNK    256         // Messages per stream chunk
+
+/* Internal Functions */
+
+/**
+ * Compute FNV-1a hash of string.
+ * @param   s           String to hash.
+ * @return  Hash value.
+ */
+static size_t broker_hash(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Lookup inbox with specified name.
+ * @param   b           Broker structure.
+ * @param   name        Name of queue.
+ * @return  Inbox structure (or NULL if there is no such queue).
+ */
+static Inbox *broker_lookup(Broker *b, const char *name) {
+    for (Inbox *i = b->buckets[broker_hash(name) & (b->nbuckets - 1)]; i; i = i->next) {
+        if (streq(i->name, name))
+            return i;
+    }
+    return NULL;
+}
+
+/**
+ * Lookup inbox with specified name (creating it if it does not exist).
+ * @param   b           Broker structure.
+ * @param   name        Name of queue.
+ * @return  Inbox structure (or NULL on allocation failure).
+ */
+static Inbox *broker_inbox(Broker *b, const char *name) {
+    Inbox *inbox = broker_lookup(b, name);
+    if (inbox)
+        return inbox;
+
+    /* Grow hash table once it is fully loaded */
+    if (b->ninboxes >= b->nbuckets) {
+        size_t   nbuckets = b->nbuckets << 1;
+        Inbox ** buckets  = calloc(nbuckets, sizeof(Inbox *));
+        if (!buckets)
+            return NULL;
+
+        for (Inbox *i = b->inboxes; i; i = i->lnext) {
+            size_t bucket = broker_hash(i->name) & (nbuckets - 1);
+            i->next = buckets[bucket];
+            buckets[bucket] = i;
+        }
+
+        free(b->buckets);
+        b->buckets  = buckets;
+        b->nbuckets = nbuckets;
+    }
+
+    inbox = calloc(1, sizeof(Inbox));
+    if (!inbox)
+        return NULL;
+
+    inbox->name     = strdup(name);
+    inbox->messages = queue_create_bounded(b->max_messages, b->max_bytes, b->overflow);
+    if (!inbox->name || !inbox->messages) {
+        free(inbox->name);
+        queue_delete(inbox->messages);
+        free(inbox);
+        return NULL;
+    }
+
+    size_t bucket = broker_hash(name) & (b->nbuckets - 1);
+    inbox->next       = b->buckets[bucket];
+    b->buckets[bucket] = inbox;
+    inbox->lnext      = b->inboxes;
+    b->inboxes        = inbox;
+    b->ninboxes++;
+    return inbox;
+}
+
+/**
+ * Lookup topic with specified name (creating it if it does not exist and
+ * create is set).
+ * @param   b           Broker structure.
+ * @param   name        Name of topic.
+ * @param   create      Whether or not to create missing topic.
+ * @return  Topic structure (or NULL if there is no such topic or on
+ *          allocation failure).
+ */
+static Topic *broker_topic(Broker *b, const char *name, bool create) {
+    for (Topic *t = b->tbuckets[broker_hash(name) & (b->ntbuckets - 1)]; t; t = t->next) {
+        if (streq(t->name, name))
+            return t;
+    }
+
+    if (!create)
+        return NULL;
+
+    /* Grow hash table once it is fully loaded */
+    if (b->ntopics >= b->ntbuckets) {
+        size_t   ntbuckets = b->ntbuckets << 1;
+        Topic ** tbuckets  = calloc(ntbuckets, sizeof(Topic *));
+        if (!tbuckets)
+            return NULL;
+
+        for (size_t bucket = 0; bucket < b->ntbuckets; bucket++) {
+            Topic *next;
+            for (Topic *t = b->tbuckets[bucket]; t; t = next) {
+                size_t nbucket = broker_hash(t->name) & (ntbuckets - 1);
+                next = t->next;
+                t->next = tbuckets[nbucket];
+                tbuckets[nbucket] = t;
+            }
+        }
+
+        free(b->tbuckets);
+        b->tbuckets  = tbuckets;
+        b->ntbuckets = ntbuckets;
+    }
+
+    Topic *topic = calloc(1, sizeof(Topic));
+    if (!topic || !(topic->name = strdup(name))) {
+        free(topic);
+        return NULL;
+    }
+
+    size_t bucket = broker_hash(name) & (b->ntbuckets - 1);
+    topic->next        = b->tbuckets[bucket];
+    b->tbuckets[bucket] = topic;
+    b->ntopics++;
+    return topic;
+}
+
+/**
+ * Remove inbox from topic's subscribers (deleting the topic once it has none).
+ * @param   b           Broker structure.
+ * @param   topic       Topic structure.
+ * @param   inbox       Inbox structure.
+ */
+static void broker_topic_remove(Broker *b, Topic *topic, Inbox *inbox) {
+    for (size_t i = 0; i < topic->ninboxes; i++) {
+        if (topic->inboxes[i] == inbox) {
+            topic->inboxes[i] = topic->inboxes[--topic->ninboxes];
+            break;
+        }
+    }
+
+    if (topic->ninboxes)
+        return;
+
+    for (Topic **t = &b->tbuckets[broker_hash(topic->name) & (b->ntbuckets - 1)]; *t; t = &(*t)->next) {
+        if (*t == topic) {
+            *t = topic->next;
+            break;
+        }
+    }
+
+    b->ntopics--;
+    free(topic->inboxes);
+    free(topic->name);
+    free(topic);
+}
+
+/**
+ * Find index of topic in inbox's subscriptions.
+ * @param   inbox       Inbox structure.
+ * @param   topic       Topic string.
+ * @return  Index of topic (or -1 if not subscribed).
+ */
+static ssize_t inbox_find(Inbox *inbox, const char *topic) {
+    for (size_t t = 0; t < inbox->ntopics; t++) {
+        if (streq(inbox->topics[t], topic))
+            return t;
+    }
+    return -1;
+}
+
+/**
+ * Complete retrieval with the oldest stored message (or, for a batch
+ * retrieval, with up to response->max stored messages as length-prefixed
+ * frames).  The inbox must have at least one stored message.
+ * @param   inbox       Inbox structure.
+ * @param   response    Response structure.
+ */
+static void inbox_respond(Inbox *inbox, Response *response) {
+    response->status = 200;
+    response->ready  = true;
+
+    if (!response->max) {
+        response->message = queue_pop(inbox->messages);
+        return;
+    }
+
+    Buffer batch;
+    buffer_init(&batch);
+    for (size_t m = 0; m < response->max && inbox->messages->size; m++) {
+        Request *message = queue_pop(inbox->messages);
+        if (!http_frame_append(&batch, message->body, request_length(message)))
+            response->status = 500;
+        request_delete(message);
+    }
+
+    if (response->status == 200)
+        response->message = request_create_body(NULL, NULL, buffer_head(&batch), buffer_length(&batch));
+    buffer_free(&batch);
+}
+
+/**
+ * Deliver message to inbox: store it and then hand stored messages to the
+ * oldest waiting retrievals (a stream at the head takes every message as its
+ * connection is flushed).
+ * @param   inbox       Inbox structure.
+ * @param   message     Request structure with message body (or NULL to only
+ *                      satisfy waiting retrievals).
+ * @return  Whether or not the message was stored (false if the inbox is full
+ *          and rejects messages, in which case the message is deleted).
+ */
+static bool inbox_deliver(Inbox *inbox, Request *message) {
+    bool stored = true;
+
+    if (message && !(stored = queue_push(inbox->messages, message)))
+        request_delete(message);
+
+    while (inbox->whead && inbox->messages->size) {
+        Response *response = inbox->whead;
+
+        if (response->stream) {
+            connection_mark(response->connection);
+            break;
+        }
+
+        inbox->whead = response->wnext;
+        if (!inbox->whead)
+            inbox->wtail = NULL;
+
+        response->waiting = NULL;
+        inbox_respond(inbox, response);
+        connection_mark(response->connection);
+    }
+
+    return stored;
+}
+
+/**
+ * Return whether or not a stream is attached to inbox.  A stream takes every
+ * message, so retrievals are refused while one is attached and it is always
+ * the last response waiting.
+ * @param   inbox       Inbox structure.
+ */
+static bool inbox_streamed(Inbox *inbox) {
+    return inbox->wtail && inbox->wtail->stream;
+}
+
+/**
+ * Parse unsigned integer parameter from query string (name=value&...).
+ * @param   query       Query string (or NULL).
+ * @param   name        Name of parameter.
+ * @param   value       Set to value of parameter (0 if malformed).
+ * @return  Whether or not the parameter is present.
+ */
+static bool broker_query(const char *query, const char *name, size_t *value) {
+    size_t nlength = strlen(name);
+
+    for (const char *s = query; s && *s; s = strchr(s, '&') ? strchr(s, '&') + 1 : NULL) {
+        if (strncmp(s, name, nlength) || s[nlength] != '=')
+            continue;
+
+        char *end;
+        s += nlength + 1;
+        *value = strtoul(s, &end, 10);
+        if (end == s || (*end && *end != '&') || *s == '-')
+            *value = 0;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Complete response with formatted text body.
+ * @param   response    Response structure.
+ * @param   status      HTTP status code.
+ * @param   format      Format string for body.
+ */
+static void respond(Response *response, int status, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    if (vasprintf(&response->text, format, args) < 0)
+        response->text = NULL;
+    va_end(args);
+
+    response->status = response->text ? status : 500;
+    response->ready  = true;
+}
+
+/**
+ * Publish message (request body) to each queue that is subscribed to topic
+ * (answering 500 if any copy of it could not be allocated).
+ */
+static void broker_topic_put(Broker *b, const char *topic, Request *r, Response *response) {
+    const char *body        = r->body ? r->body : "";
+    size_t      length      = request_length(r);
+    Topic *     t           = broker_topic(b, topic, false);
+    size_t      subscribers = t ? t->ninboxes : 0;
+    size_t      stored      = 0;
+    size_t      failed      = 0;
+
+    /* Bodies are delimited by Content-Length (and may hold NUL bytes) */
+    for (size_t i = 0; i < subscribers; i++) {
+        Request *message = request_create_body(NULL, NULL, body, length);
+        if (message)
+            stored += inbox_deliver(t->inboxes[i], message);
+        else
+            failed++;
+    }
+
+    if (failed) {
+        respond(response, 500, "Unable to allocate message for %lu of %lu subscribers of %s\n",
+                failed, subscribers, topic);
+    } else if (stored) {
+        respond(response, 200, "Published message (%lu bytes) to %lu subscribers of %s\n",
+                length, stored, topic);
+    } else if (subscribers) {
+        respond(response, 503, "Every queue subscribed to topic is full: %s\n", topic);
+    } else {
+        respond(response, 404, "There are no subscribers for topic: %s\n", topic);
+    }
+}
+
+/**
+ * Publish batch of messages (length-prefixed frames of request body) to each
+ * queue that is subscribed to topic.  The frames are located once up front, so
+ * a malformed batch publishes nothing.  A queue whose messages cannot all be
+ * allocated keeps those stored before the failure, and the publish is answered
+ * with 500.
+ */
+static void broker_topic_put_batch(Broker *b, const char *topic, size_t count, Request *r, Response *response) {
+    const char *data        = r->body ? r->body : "";
+    size_t      length      = request_length(r);
+    size_t      offset      = 0;
+    size_t      bytes       = 0;
+    size_t      subscribers = 0;
+    size_t      m           = 0;
+
+    /* Every frame takes at least two bytes ("0\n") */
+    struct iovec *frames = count && count <= length / 2 ? malloc(count * sizeof(struct iovec)) : NULL;
+
+    for (; frames && m < count && offset < length; m++) {
+        const char *frame;
+        size_t      flength;
+        ssize_t     n = http_frame_next(data + offset, length - offset, &frame, &flength);
+        if (n < 0)
+            break;
+
+        frames[m].iov_base = (void *)frame;
+        frames[m].iov_len  = flength;
+        offset += n;
+        bytes  += flength;
+    }
+
+    if (!frames || m != count || offset != length) {
+        respond(response, 400, "Invalid batch of %lu messages for topic: %s\n", count, topic);
+        free(frames);
+        return;
+    }
+
+    Topic *t      = broker_topic(b, topic, false);
+    size_t stored = 0;
+    size_t failed = 0;
+    for (; t && subscribers < t->ninboxes; subscribers++) {
+        Inbox *i = t->inboxes[subscribers];
+        size_t n = 0;
+
+        for (m = 0; m < count; m++) {
+            Request *message = request_create_body(NULL, NULL, frames[m].iov_base, frames[m].iov_len);
+            if (!message)
+                break;
+            if (queue_push(i->messages, message))
+                n++;
+            else
+                request_delete(message);
+        }
+        inbox_deliver(i, NULL);
+        stored += n > 0;
+        failed += m < count;
+    }
+
+    if (failed) {
+        respond(response, 500, "Unable to allocate messages for %lu of %lu subscribers of %s\n",
+                failed, subscribers, topic);
+    } else if (stored) {
+        respond(response, 200, "Published %lu messages (%lu bytes) to %lu subscribers of %s\n",
+                count, bytes, stored, topic);
+    } else if (subscribers) {
+        respond(response, 503, "Every queue subscribed to topic is full: %s\n", topic);
+    } else {
+        respond(response, 404, "There are no subscribers for topic: %s\n", topic);
+    }
+
+    free(frames);
+}
+
+/**
+ * Retrieve one message (or a framed batch of up to max messages) from queue
+ * (wait until one is available).  Refused with 409 while the queue is being
+ * streamed, as the stream would take every message.
+ */
+static void broker_queue_get(Broker *b, const char *queue, size_t max, Response *response) {
+    Inbox *inbox = broker_lookup(b, queue);
+
+    if (!inbox) {
+        respond(response, 404, "There is no queue named: %s\n", queue);
+        return;
+    }
+
+    if (inbox_streamed(inbox)) {
+        respond(response, 409, "Queue is being streamed: %s\n", queue);
+        return;
+    }
+
+    response->max = max;
+    if (inbox->messages->size) {
+        inbox_respond(inbox, response);
+        return;
+    }
+
+    response->waiting = inbox;
+    if (inbox->wtail)
+        inbox->wtail->wnext = response;
+    else
+        inbox->whead = response;
+    inbox->wtail = response;
+}
+
+/**
+ * Stream messages from queue (creating it if it does not exist) for as long
+ * as the connection stays open.  The response is written by broker_stream
+ * whenever its connection is flushed.  Refused with 409 if the queue is
+ * already being streamed.
+ */
+static void broker_queue_stream(Broker *b, const char *queue, Response *response) {
+    Inbox *inbox = broker_inbox(b, queue);
+
+    if (!inbox) {
+        respond(response, 500, "Unable to stream queue: %s\n", queue);
+        return;
+    }
+
+    if (inbox_streamed(inbox)) {
+        respond(response, 409, "Queue is being streamed: %s\n", queue);
+        return;
+    }
+
+    response->status  = 200;
+    response->stream  = true;
+    response->ready   = true;
+    response->waiting = inbox;
+    if (inbox->wtail)
+        inbox->wtail->wnext = response;
+    else
+        inbox->whead = response;
+    inbox->wtail = response;
+}
+
+/**
+ * Subscribe queue to topic.
+ */
+static void broker_subscription_put(Broker *b, const char *queue, const char *topic, Response *response) {
+    Inbox *inbox = broker_inbox(b, queue);
+
+    if (inbox && inbox_find(inbox, topic) < 0) {
+        Topic *t = broker_topic(b, topic, true);
+
+        if (t && inbox->ntopics == inbox->ctopics) {
+            size_t ctopics = inbox->ctopics ? inbox->ctopics << 1 : 4;
+            char **topics  = realloc(inbox->topics, ctopics * sizeof(char *));
+            if (topics) {
+                inbox->topics  = topics;
+                inbox->ctopics = ctopics;
+            }
+        }
+
+        if (t && t->ninboxes == t->cinboxes) {
+            size_t  cinboxes = t->cinboxes ? t->cinboxes << 1 : 4;
+            Inbox **inboxes  = realloc(t->inboxes, cinboxes * sizeof(Inbox *));
+            if (inboxes) {
+                t->inboxes  = inboxes;
+                t->cinboxes = cinboxes;
+            }
+        }
+
+        char *name = t ? strdup(topic) : NULL;
+        if (!name || inbox->ntopics == inbox->ctopics || t->ninboxes == t->cinboxes) {
+            free(name);
+            if (t && !t->ninboxes)
+                broker_topic_remove(b, t, inbox);
+            respond(response, 500, "Unable to subscribe queue (%s) to topic (%s)\n", queue, topic);
+            return;
+        }
+
+        inbox->topics[inbox->ntopics++] = name;
+        t->inboxes[t->ninboxes++]       = inbox;
+    }
+
+    respond(response, 200, "Subscribed queue (%s) to topic (%s)\n", queue, topic);
+}
+
+/**
+ * Unsubscribe queue from topic.
+ */
+static void broker_subscription_delete(Broker *b, const char *queue, const char *topic, Response *response) {
+    Inbox * inbox = broker_lookup(b, queue);
+    ssize_t index = inbox ? inbox_find(inbox, topic) : -1;
+
+    if (index < 0) {
+        respond(response, 404, "There is no queue named: %s\n", queue);
+        return;
+    }
+
+    Topic *t = broker_topic(b, topic, false);
+    if (t)
+        broker_topic_remove(b, t, inbox);
+
+    free(inbox->topics[index]);
+    inbox->topics[index] = inbox->topics[--inbox->ntopics];
+    respond(response, 200, "Unsubscribed queue (%s) from topic (%s)\n", queue, topic);
+}
+
+/* External Functions */
+
+/**
+ * Create Broker structure.
+ * @param   debug           Whether or not to log each request.
+ * @param   max_messages    Most messages stored per queue (0 for unlimited).
+ * @param   max_bytes       Most message bytes stored per queue (0 for unlimited).
+ * @param   overflow        What a full queue does with new messages: reject
+ *                          them (QUEUE_FAIL) or make room by deleting its
+ *                          oldest ones (QUEUE_DROP_OLDEST).
+ * @return  Newly allocated Broker structure.
+ */
+Broker *broker_create(bool debug, size_t max_messages, size_t max_bytes, QueuePolicy overflow) {
+    Broker *b = calloc(1, sizeof(Broker));
+
+    if (b) {
+        b->nbuckets  = BROKER_BUCKETS;
+        b->buckets   = calloc(b->nbuckets, sizeof(Inbox *));
+        b->ntbuckets = BROKER_BUCKETS;
+        b->tbuckets  = calloc(b->ntbuckets, sizeof(Topic *));
+        b->debug     = debug;
+
+        b->max_messages = max_messages;
+        b->max_bytes    = max_bytes;
+        b->overflow     = overflow == QUEUE_FAIL ? QUEUE_FAIL : QUEUE_DROP_OLDEST;
+        if (!b->buckets || !b->tbuckets) {
+            free(b->buckets);
+            free(b->tbuckets);
+            free(b);
+            return NULL;
+        }
+    }
+
+    return b;
+}
+
+/**
+ * Delete Broker structure (and all queues).
+ * @param   b           Broker structure.
+ */
+void broker_delete(Broker *b) {
+    if (b) {
+        Inbox *next;
+        for (Inbox *i = b->inboxes; i; i = next) {
+            next = i->lnext;
+            for (size_t t = 0; t < i->ntopics; t++)
+                free(i->topics[t]);
+            free(i->topics);
+            free(i->name);
+            queue_delete(i->messages);
+            free(i);
+        }
+        free(b->buckets);
+
+        for (size_t bucket = 0; bucket < b->ntbuckets; bucket++) {
+            Topic *tnext;
+            for (Topic *t = b->tbuckets[bucket]; t; t = tnext) {
+                tnext = t->next;
+                free(t->inboxes);
+                free(t->name);
+                free(t);
+            }
+        }
+        free(b->tbuckets);
+    }
+
+    free(b);
+}
+
+/**
+ * Handle request by dispatching on its uri:
+ *
+ *  PUT     /topic/$topic               Publish message to $topic.
+ *  PUT     /topic/$topic?batch=$n      Publish $n length-prefixed messages to $topic.
+ *  GET     /queue/$queue               Retrieve one message from $queue.
+ *  GET     /queue/$queue?max=$n        Retrieve up to $n length-prefixed messages from $queue.
+ *  GET     /stream/$queue              Stream length-prefixed messages from $queue as chunks.
+ *  PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
+ *  DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+ *
+ * The response is either completed immediately or, for retrievals from an
+ * empty queue, completed later when a message is published.  Streams are
+ * never completed.
+ *
+ * @param   b           Broker structure.
+ * @param   r           Request structure.
+ * @param   response    Response structure.
+ */
+void broker_handle(Broker *b, Request *r, Response *response) {
+    char *path = strdup(r->uri);
+    char *s;
+
+    if (!path) {
+        respond(response, 500, "Out of memory\n");
+        return;
+    }
+
+    if (b->debug)
+        info("%s %s", r->method, r->uri);
+
+    char *query = NULL;
+    if ((s = strchr(path, '?'))) {
+        *s    = 0;
+        query = s + 1;
+    }
+
+    size_t batch, max;
+    if ((s = strstr(path, "/topic/"))) {
+        if (streq(r->method, "PUT") && broker_query(query, "batch", &batch))
+            broker_topic_put_batch(b, s + 7, batch, r, response);
+        else if (streq(r->method, "PUT"))
+            broker_topic_put(b, s + 7, r, response);
+        else
+            respond(response, 405, "Method Not Allowed\n");
+    } else if ((s = strstr(path, "/queue/"))) {
+        if (!streq(r->method, "GET"))
+            respond(response, 405, "Method Not Allowed\n");
+        else if (!broker_query(query, "max", &max))
+            broker_queue_get(b, s + 7, 0, response);
+        else if (max)
+            broker_queue_get(b, s + 7, max, response);
+        else
+            respond(response, 400, "Invalid maximum number of messages for queue: %s\n", s + 7);
+    } else if ((s = strstr(path, "/stream/"))) {
+        if (!streq(r->method, "GET"))
+            respond(response, 405, "Method Not Allowed\n");
+        else
+            broker_queue_stream(b, s + 8, response);
+    } else if ((s = strstr(path, "/subscription/")) && strchr(s + 14, '/')) {
+        char *queue = s + 14;
+        char *topic = strrchr(queue, '/');
+        *topic++ = 0;
+
+        if (streq(r->method, "PUT"))
+            broker_subscription_put(b, queue, topic, response);
+        else if (streq(r->method, "DELETE"))
+            broker_subscription_delete(b, queue, topic, response);
+        else
+            respond(response, 405, "Method Not Allowed\n");
+    } else {
+        respond(response, 404, "Not Found\n");
+    }
+
+    free(path);
+}
+
+/**
+ * Cancel response waiting on a queue (because its connection was closed).
+ * @param   b           Broker structure.
+ * @param   response    Response structure.
+ */
+void broker_cancel(Broker *b, Response *response) {
+    Inbox *inbox = response->waiting;
+    if (!inbox)
+        return;
+
+    Response *prev = NULL;
+    for (Response *w = inbox->whead; w; prev = w, w = w->wnext) {
+        if (w != response)
+            continue;
+
+        if (prev)
+            prev->wnext  = w->wnext;
+        else
+            inbox->whead = w->wnext;
+        if (inbox->wtail == w)
+            inbox->wtail = prev;
+        break;
+    }
+
+    response->waiting = NULL;
+}
+
+/**
+ * Append stream header (the first time) and then queued messages as chunks
+ * of length-prefixed frames to buffer, until the queue is empty or the buffer
+ * holds BROKER_STREAM bytes (the rest stay queued until it drains).
+ * @param   response    Response structure (streaming).
+ * @param   b           Buffer structure.
+ * @return  Whether or not the stream was appended.
+ */
+bool broker_stream(Response *response, Buffer *b) {
+    Inbox *  inbox = response->waiting;
+    Request *messages[BROKER_CHUNK];
+
+    if (!response->started) {
+        if (!http_write_stream(b))
+            return false;
+        response->started = true;
+    }
+
+    while (inbox && inbox->messages->size && buffer_length(b) < BROKER_STREAM) {
+        size_t n      = queue_pop_batch(inbox->messages, messages, BROKER_CHUNK);
+        size_t length = 0;
+
+        for (size_t m = 0; m < n; m++)
+            length += http_frame_length(request_length(messages[m]));
+
+        bool status = http_chunk_begin(b, length);
+        for (size_t m = 0; m < n; m++) {
+            status = status && http_frame_append(b, messages[m]->body, request_length(messages[m]));
+            request_delete(messages[m]);
+        }
+        if (!status || !http_chunk_end(b))
+            return false;
+    }
+
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,106 @@
+/* broker.h: Native Message Queue Broker */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include "mq/buffer.h"
+#include "mq/http.h"
+#include "mq/queue.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Structures */
+
+typedef struct Broker     Broker;
+typedef struct Connection Connection;
+typedef struct Inbox      Inbox;
+typedef struct Response   Response;
+typedef struct Topic      Topic;
+
+struct Response {
+    int         status;         // HTTP status code
+    char *      text;           // Generated response body (if any)
+    Request *   message;        // Message being delivered (if any)
+    size_t      max;            // Messages to deliver as a framed batch (0 for one unframed)
+    int         flags;          // HTTP flags of request
+    bool        ready;          // Whether or not response is complete (or may start streaming)
+    bool        stream;         // Whether or not messages are streamed as chunks indefinitely
+    bool        started;        // Whether or not stream header has been written
+
+    Connection *connection;     // Connection response will be written to
+    Inbox *     waiting;        // Inbox response is waiting on (if any)
+    Response *  next;           // Next response on connection (in order)
+    Response *  wnext;          // Next response waiting on inbox (in order)
+};
+
+struct Inbox {
+    char *      name;           // Name of queue
+    Queue *     messages;       // Messages not yet retrieved
+    char **     topics;         // Topics queue is subscribed to
+    size_t      ntopics;
+    size_t      ctopics;
+
+    Response *  whead;          // Retrievals waiting for a message (a stream is always last)
+    Response *  wtail;
+    Inbox *     next;           // Next inbox in hash bucket
+    Inbox *     lnext;          // Next inbox in broker
+};
+
+struct Topic {
+    char *      name;           // Name of topic
+    Inbox **    inboxes;        // Queues subscribed to topic
+    size_t      ninboxes;
+    size_t      cinboxes;
+
+    Topic *     next;           // Next topic in hash bucket
+};
+
+struct Broker {
+    Inbox **    buckets;        // Hash table of inboxes by name
+    size_t      nbuckets;
+    size_t      ninboxes;
+    Inbox *     inboxes;        // All inboxes
+
+    Topic **    tbuckets;       // Hash table of topics (with subscribers) by name
+    size_t      ntbuckets;
+    size_t      ntopics;
+
+    size_t      max_messages;   // Most messages stored per queue (0 for unlimited)
+    size_t      max_bytes;      // Most message bytes stored per queue (0 for unlimited)
+    QueuePolicy overflow;       // What a full queue does (QUEUE_FAIL or QUEUE_DROP_OLDEST)
+    bool        debug;          // Whether or not to log each request
+};
+
+struct Connection {
+    int         fd;
+    Buffer      rbuffer;        // Bytes received but not yet parsed
+    Buffer      wbuffer;        // Bytes waiting to be sent
+    HTTPParser  parser;
+
+    Response *  head;           // Responses not yet written (in order)
+    Response *  tail;
+    uint32_t    events;         // Events connection is registered for
+    bool        eof;            // Peer has stopped sending
+    bool        finished;       // No further requests will be read
+    bool        closing;        // Close once write buffer is flushed
+    bool        closed;
+    bool        dirty;          // Has responses ready to be flushed
+    Connection *dnext;          // Next dirty connection
+    Connection *cnext;          // Next closed connection
+};
+
+/* Functions */
+
+Broker *    broker_create(bool debug, size_t max_messages, size_t max_bytes, QueuePolicy overflow);
+void        broker_delete(Broker *b);
+
+void        broker_handle(Broker *b, Request *r, Response *response);
+void        broker_cancel(Broker *b, Response *response);
+bool        broker_stream(Response *response, Buffer *b);
+
+void        connection_mark(Connection *c);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,424 @@
+/* mq_server.c: Native Message Queue Server
+ *
+ * Serves the same REST API as bin/mq_server.py from a single epoll event loop
+ * over non-blocking sockets.  Each connection parses requests incrementally
+ * and may pipeline them: requests are handled as soon as they are parsed,
+ * while responses are written back in request order (a retrieval from an
+ * empty queue holds back the responses behind it until a message arrives).
+ */
+
+#define _GNU_SOURCE
+
+#include "broker.h"
+
+#include "mq/logging.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define DEFAULT_ADDRESS "0.0.0.0"
+#define DEFAULT_PORT    "9620"
+#define MAX_EVENTS      256
+#define READ_MAX        (HTTP_HEADER_MAX + HTTP_BODY_MAX)   // Most bytes buffered ahead of parsing (room for any one request)
+#define WRITE_HIGH      (1<<22)                             // Requests are not read while more bytes than this wait to be sent
+
+/* Globals */
+
+static Broker *     TheBroker = NULL;
+static int          EpollFD   = -1;
+static Connection * Dirty     = NULL;
+static Connection * Closed    = NULL;
+static volatile sig_atomic_t Running = 1;
+
+/* Responses */
+
+/**
+ * Create response to the next request on connection (appended in order).
+ * @param   c           Connection structure.
+ * @param   flags       HTTP flags of request.
+ * @return  Newly allocated Response structure.
+ */
+static Response *response_create(Connection *c, int flags) {
+    Response *response = calloc(1, sizeof(Response));
+
+    if (response) {
+        response->flags      = flags;
+        response->connection = c;
+        if (c->tail)
+            c->tail->next = response;
+        else
+            c->head = response;
+        c->tail = response;
+    }
+
+    return response;
+}
+
+/**
+ * Delete Response structure.
+ * @param   response    Response structure.
+ */
+static void response_delete(Response *response) {
+    if (response) {
+        free(response->text);
+        request_delete(response->message);
+    }
+    free(response);
+}
+
+/* Connections */
+
+/**
+ * Mark connection as having responses ready to be flushed (at the end of the
+ * current event loop iteration).
+ * @param   c           Connection structure.
+ */
+void connection_mark(Connection *c) {
+    if (c->dirty || c->closed)
+        return;
+
+    c->dirty = true;
+    c->dnext = Dirty;
+    Dirty    = c;
+}
+
+/**
+ * Create connection for accepted socket and register it with event loop.
+ * @param   fd          Socket file descriptor.
+ * @return  Newly allocated Connection structure.
+ */
+static Connection *connection_create(int fd) {
+    Connection *c = calloc(1, sizeof(Connection));
+    if (!c)
+        return NULL;
+
+    c->fd     = fd;
+    c->events = EPOLLIN | EPOLLRDHUP;
+    buffer_init(&c->rbuffer);
+    buffer_init(&c->wbuffer);
+    http_parser_init(&c->parser);
+
+    struct epoll_event event = { .events = c->events, .data.ptr = c };
+    if (epoll_ctl(EpollFD, EPOLL_CTL_ADD, fd, &event) < 0) {
+        error("Unable to register connection: %s", strerror(errno));
+        free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/**
+ * Close connection and discard any outstanding responses (the structure
+ * itself is released at the end of the current event loop iteration).
+ * @param   c           Connection structure.
+ */
+static void connection_close(Connection *c) {
+    if (c->closed)
+        return;
+
+    Response *next;
+    for (Response *response = c->head; response; response = next) {
+        next = response->next;
+        broker_cancel(TheBroker, response);
+        response_delete(response);
+    }
+    c->head = c->tail = NULL;
+
+    epoll_ctl(EpollFD, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    buffer_free(&c->rbuffer);
+    buffer_free(&c->wbuffer);
+
+    c->closed = true;
+    c->cnext  = Closed;
+    Closed    = c;
+}
+
+/**
+ * Read available bytes from connection (up to READ_MAX buffered) and handle
+ * each complete request.  Requests over the HTTP limits are answered with 413
+ * and malformed ones with 400, after which the connection reads no more.
+ * @param   c           Connection structure.
+ */
+static void connection_read(Connection *c) {
+    while (!c->eof && buffer_length(&c->rbuffer) < READ_MAX) {
+        ssize_t n = buffer_read(&c->rbuffer, c->fd);
+        if (n == 0) {
+            c->eof = true;
+        } else if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            connection_close(c);
+            return;
+        }
+    }
+
+    while (!c->finished && buffer_length(&c->rbuffer)) {
+        Request *r = NULL;
+        int flags  = 0;
+        ssize_t n  = http_parse_request(&c->parser, buffer_head(&c->rbuffer), buffer_length(&c->rbuffer), &r, &flags);
+        if (n == 0)
+            break;
+
+        Response *response = response_create(c, n < 0 ? 0 : flags);
+        if (!response) {
+            request_delete(r);
+            connection_close(c);
+            return;
+        }
+
+        if (n < 0) {
+            response->status = n == HTTP_TOO_LARGE ? 413 : 400;
+            response->text   = strdup(n == HTTP_TOO_LARGE ? "Payload Too Large\n" : "Bad Request\n");
+            response->ready  = true;
+            c->finished      = true;
+            break;
+        }
+
+        buffer_consume(&c->rbuffer, n);
+        broker_handle(TheBroker, r, response);
+        request_delete(r);
+
+        /* A stream is never completed, so nothing after it could be answered */
+        if (!(flags & HTTP_KEEPALIVE) || response->stream)
+            c->finished = true;
+    }
+
+    if (c->eof)
+        c->finished = true;
+    connection_mark(c);
+}
+
+/**
+ * Write ready responses (in order) and update event registration.  A stream
+ * at the head of the connection takes whatever messages are queued for it.
+ * @param   c           Connection structure.
+ */
+static void connection_flush(Connection *c) {
+    while (!c->closing && c->head && c->head->ready) {
+        Response *  response = c->head;
+
+        if (response->stream) {
+            if (!broker_stream(response, &c->wbuffer)) {
+                connection_close(c);
+                return;
+            }
+            break;
+        }
+
+        const char *body     = response->message ? response->message->body : response->text;
+        size_t      length   = response->message ? request_length(response->message) : (body ? strlen(body) : 0);
+
+        if (!http_write_response(&c->wbuffer, response->status, body, length, response->flags)) {
+            connection_close(c);
+            return;
+        }
+
+        if (!(response->flags & HTTP_KEEPALIVE))
+            c->closing = true;
+
+        c->head = response->next;
+        if (!c->head)
+            c->tail = NULL;
+        response_delete(response);
+    }
+
+    if (buffer_write(&c->wbuffer, c->fd) < 0) {
+        connection_close(c);
+        return;
+    }
+
+    /* Stream stopped at its buffer limit but it all went out: keep going */
+    if (!buffer_length(&c->wbuffer) && c->head && c->head->stream &&
+        c->head->waiting && c->head->waiting->messages->size)
+        connection_mark(c);
+
+    if (!buffer_length(&c->wbuffer) && (c->closing || c->eof)) {
+        connection_close(c);
+        return;
+    }
+
+    /* Stop reading requests while their responses back up (the peer is not
+     * reading), picking up again once the write buffer drains (a half-close
+     * is only watched for once no more requests will be read) */
+    bool     paused = !c->finished && buffer_length(&c->wbuffer) > WRITE_HIGH;
+    uint32_t events = (c->finished || paused ? 0 : EPOLLIN)
+                    | (c->eof || paused ? 0 : EPOLLRDHUP)
+                    | (buffer_length(&c->wbuffer) ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event event = { .events = events, .data.ptr = c };
+        epoll_ctl(EpollFD, EPOLL_CTL_MOD, c->fd, &event);
+        c->events = events;
+    }
+}
+
+/**
+ * Accept all pending connections on listening socket.
+ * @param   server_fd   Listening socket file descriptor.
+ */
+static void server_accept(int server_fd) {
+    while (true) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                error("Unable to accept: %s", strerror(errno));
+            return;
+        }
+
+        int on = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        if (!connection_create(client_fd))
+            close(client_fd);
+    }
+}
+
+/* Main execution */
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options]\n\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    --address=ADDRESS   Address to listen on (default: %s)\n", DEFAULT_ADDRESS);
+    fprintf(stderr, "                        (unix:/path or unix:@name for a Unix domain socket)\n");
+    fprintf(stderr, "    --port=PORT         Port to listen on (default: %s)\n", DEFAULT_PORT);
+    fprintf(stderr, "    --max-messages=N    Most messages stored per queue (default: unlimited)\n");
+    fprintf(stderr, "    --max-bytes=N       Most message bytes stored per queue (default: unlimited)\n");
+    fprintf(stderr, "    --overflow=POLICY   What a full queue does: drop (oldest) or reject (default: drop)\n");
+    fprintf(stderr, "    --debug             Log each request\n");
+    exit(status);
+}
+
+static void handle_signal(int signum) {
+    Running = 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *address = DEFAULT_ADDRESS;
+    const char *port    = DEFAULT_PORT;
+    bool        debug   = false;
+    size_t      max_messages = 0;
+    size_t      max_bytes    = 0;
+    QueuePolicy overflow     = QUEUE_DROP_OLDEST;
+
+    /* Parse command-line arguments */
+    for (int argind = 1; argind < argc; argind++) {
+        char *arg = argv[argind];
+
+        if (strncmp(arg, "--address=", 10) == 0) {
+            address = arg + 10;
+        } else if (strncmp(arg, "--port=", 7) == 0) {
+            port = arg + 7;
+        } else if (strncmp(arg, "--max-messages=", 15) == 0) {
+            max_messages = strtoul(arg + 15, NULL, 10);
+        } else if (strncmp(arg, "--max-bytes=", 12) == 0) {
+            max_bytes = strtoul(arg + 12, NULL, 10);
+        } else if (streq(arg, "--overflow=drop")) {
+            overflow = QUEUE_DROP_OLDEST;
+        } else if (streq(arg, "--overflow=reject")) {
+            overflow = QUEUE_FAIL;
+        } else if (streq(arg, "--debug") || streq(arg, "--debug=true")) {
+            debug = true;
+        } else if (streq(arg, "-h") || streq(arg, "--help")) {
+            usage(argv[0], EXIT_SUCCESS);
+        } else {
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    /* Setup signals */
+    struct sigaction action = { .sa_handler = handle_signal };
+    sigaction(SIGINT , &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Setup broker and event loop */
+    int server_fd = socket_listen(address, port);
+    if (server_fd < 0)
+        return EXIT_FAILURE;
+
+    TheBroker = broker_create(debug, max_messages, max_bytes, overflow);
+    EpollFD   = epoll_create1(0);
+    if (!TheBroker || EpollFD < 0) {
+        error("Unable to create broker: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(EpollFD, EPOLL_CTL_ADD, server_fd, &event);
+
+    if (socket_is_unix(address))
+        info("Listening on %s", address);
+    else
+        info("Listening on %s:%s", address, port);
+
+    /* Run event loop */
+    struct epoll_event events[MAX_EVENTS];
+    while (Running) {
+        int n = epoll_wait(EpollFD, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Unable to wait for events: %s", strerror(errno));
+            break;
+        }
+
+        for (int e = 0; e < n; e++) {
+            Connection *c = events[e].data.ptr;
+
+            if (!c) {
+                server_accept(server_fd);
+                continue;
+            }
+
+            if (c->closed)
+                continue;
+
+            if (events[e].events & EPOLLERR) {
+                connection_close(c);
+                continue;
+            }
+
+            if (events[e].events & (EPOLLIN | EPOLLHUP))
+                connection_read(c);
+            if (events[e].events & EPOLLRDHUP && c->finished && !c->closed)
+                c->eof = true;
+            if (!c->closed)
+                connection_mark(c);
+        }
+
+        while (Dirty) {
+            Connection *c = Dirty;
+            Dirty    = c->dnext;
+            c->dirty = false;
+            if (!c->closed)
+                connection_flush(c);
+        }
+
+        while (Closed) {
+            Connection *c = Closed;
+            Closed = c->cnext;
+            free(c);
+        }
+    }
+
+    close(EpollFD);
+    close(server_fd);
+    if (socket_is_unix(address) && address[sizeof(SOCKET_UNIX) - 1] != '@')
+        unlink(address + sizeof(SOCKET_UNIX) - 1);
+    broker_delete(TheBroker);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
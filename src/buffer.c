@@ -0,0 +1,179 @@
+/* buffer.c: Growable byte buffer */
+
+#include "mq/buffer.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BUFFER_MINIMUM  (1<<12)
+
+/**
+ * Initialize empty buffer.
+ * @param   b           Buffer structure.
+ */
+void buffer_init(Buffer *b) {
+    b->data     = NULL;
+    b->start    = 0;
+    b->end      = 0;
+    b->capacity = 0;
+}
+
+/**
+ * Release buffer storage.
+ * @param   b           Buffer structure.
+ */
+void buffer_free(Buffer *b) {
+    free(b->data);
+    buffer_init(b);
+}
+
+/**
+ * Ensure there are at least n bytes of free space at the end of the buffer
+ * (by first reclaiming consumed space and then growing the storage).
+ * @param   b           Buffer structure.
+ * @param   n           Number of bytes required.
+ * @return  Whether or not the space is available.
+ */
+bool buffer_reserve(Buffer *b, size_t n) {
+    if (b->capacity - b->end >= n)
+        return true;
+
+    size_t length = buffer_length(b);
+    if (b->start && b->capacity - length >= n) {
+        memmove(b->data, buffer_head(b), length);
+        b->start = 0;
+        b->end   = length;
+        return true;
+    }
+
+    size_t capacity = b->capacity ? b->capacity : BUFFER_MINIMUM;
+    while (capacity - length < n)
+        capacity <<= 1;
+
+    char *data = malloc(capacity);
+    if (!data)
+        return false;
+
+    if (b->data)
+        memcpy(data, buffer_head(b), length);
+    free(b->data);
+    b->data     = data;
+    b->start    = 0;
+    b->end      = length;
+    b->capacity = capacity;
+    return true;
+}
+
+/**
+ * Append bytes to the end of the buffer.
+ * @param   b           Buffer structure.
+ * @param   data        Bytes to append.
+ * @param   n           Number of bytes to append.
+ * @return  Whether or not the bytes were appended.
+ */
+bool buffer_append(Buffer *b, const void *data, size_t n) {
+    if (!buffer_reserve(b, n))
+        return false;
+
+    memcpy(b->data + b->end, data, n);
+    b->end += n;
+    return true;
+}
+
+/**
+ * Append formatted string to the end of the buffer.
+ * @param   b           Buffer structure.
+ * @param   format      Format string.
+ * @return  Whether or not the string was appended.
+ */
+bool buffer_printf(Buffer *b, const char *format, ...) {
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(b->data ? b->data + b->end : NULL, b->capacity - b->end, format, args);
+    va_end(args);
+
+    if (n < 0)
+        return false;
+
+    if ((size_t)n >= b->capacity - b->end) {
+        if (!buffer_reserve(b, n + 1))
+            return false;
+
+        va_start(args, format);
+        vsnprintf(b->data + b->end, b->capacity - b->end, format, args);
+        va_end(args);
+    }
+
+    b->end += n;
+    return true;
+}
+
+/**
+ * Discard bytes from the front of the buffer.
+ * @param   b           Buffer structure.
+ * @param   n           Number of bytes to discard.
+ */
+void buffer_consume(Buffer *b, size_t n) {
+    b->start += n;
+    if (b->start >= b->end)
+        b->start = b->end = 0;
+}
+
+/**
+ * Read once from file descriptor into the end of the buffer.
+ * @param   b           Buffer structure.
+ * @param   fd          File descriptor to read from.
+ * @return  Number of bytes read (0 on end of file, -1 on error).
+ */
+ssize_t buffer_read(Buffer *b, int fd) {
+    if (!buffer_reserve(b, BUFFER_MINIMUM)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = read(fd, b->data + b->end, b->capacity - b->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        b->end += n;
+    return n;
+}
+
+/**
+ * Write as much of the buffer as possible to the file descriptor (consuming
+ * what was written).
+ * @param   b           Buffer structure.
+ * @param   fd          File descriptor to write to.
+ * @return  Number of bytes written (-1 on error).
+ */
+ssize_t buffer_write(Buffer *b, int fd) {
+    ssize_t total = 0;
+
+    while (buffer_length(b)) {
+        ssize_t n = send(fd, buffer_head(b), buffer_length(b), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        buffer_consume(b, n);
+        total += n;
+    }
+
+    return total;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,5 +1,10 @@
 /* client.c: Message Queue Client */
+#include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "mq/client.h"
@@ -10,14 +15,107 @@
 /* Internal Constants */
 
 #define SENTINEL "SHUTDOWN"
+#define MQ_BATCH 256            // Requests coalesced into one send
+#define MQ_DRAIN_TIMEOUT 5      // Seconds mq_stop waits for sent requests to be answered
+
+#define REACTOR_EVENTS  256
+#define REACTOR_WAKEUP  1       // Tags eventfd events in the low bit of their MessageQueueConnection (pointer-aligned)
+
+#define CONSUME_BATCH   64      // Messages prefetched per retrieval (consumer)
+#define CONSUME_LOCAL   128     // Messages each consumer worker holds (power of 2, at least 2 * CONSUME_BATCH)
+
+/* Internal Structures */
+
+typedef struct Reactor Reactor;
+struct Reactor {
+    int     epfd;               // Event loop shared by all attached message queues
+    int     efd;                // Eventfd signalled to stop reactor thread
+    size_t  users;              // Number of attached message queues
+    Thread  thread;
+};
+
+/* The consumer's dispatcher prefetches batches of messages and deals them in
+ * chunks to each worker's local ring, so workers normally only take their own
+ * (uncontended) lock.  A worker whose ring is empty steals the newer half of
+ * another worker's ring into a private stash before going idle.  The number
+ * of messages waiting in every ring bounds how far the dispatcher prefetches
+ * (it resumes once workers have drained half of its limit). */
+
+typedef struct ConsumerWorker ConsumerWorker;
+struct ConsumerWorker {
+    MessageQueueConsumer *consumer;
+    Thread  thread;
+    size_t  id;
+
+    Mutex   lock;               // Protects messages, head, and tail
+    char *  messages[CONSUME_LOCAL];    // Ring of messages dealt to worker
+    size_t  head;               // Next message to handle
+    size_t  tail;               // Next free slot
+
+    char *  stash[CONSUME_LOCAL / 2];   // Messages stolen from another worker (private)
+    size_t  nstash;
+};
+
+struct MessageQueueConsumer {
+    MessageQueue *      mq;
+    MessageQueueHandler handler;
+    void *              arg;
+
+    Thread  dispatcher;
+    size_t  next;               // Worker the next chunk is dealt to (dispatcher only)
+    ConsumerWorker *workers;
+    size_t  nworkers;
+
+    size_t  available;          // Messages waiting in every worker's ring (atomic)
+    size_t  limit;              // Messages prefetched before the dispatcher waits
+
+    Mutex   lock;
+    Cond    ready;              // Signalled when messages are dealt or the dispatcher finishes
+    Cond    drained;            // Signalled when available falls below half the limit or on stop
+    size_t  idle;               // Workers waiting for messages (protected by lock)
+    bool    stopping;           // Dispatcher should stop prefetching (protected by lock)
+    bool    finished;           // Dispatcher will deal no more messages (protected by lock)
+};
+
+/* Internal Globals */
+
+static Reactor  TheReactor  = { .epfd = -1, .efd = -1 };
+static Mutex    ReactorLock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Internal Prototypes */
 
 void *mq_pusher(void *);
 void *mq_puller(void *);
+void *mq_reactor(void *);
+void *mq_dispatcher(void *);
+void *mq_worker(void *);
 
-void check_response(MessageQueue *, char **body);
-Request *get_response(MessageQueue *mq);
+void mq_consumer_stop(MessageQueue *mq);
+
+void mq_reactor_attach(MessageQueue *mq);
+void mq_reactor_release();
+void mq_route(MessageQueueConnection *c, Request *r, Request *response);
+Request *mq_unframe(Request *response);
+void mq_prefetch(MessageQueue *mq, size_t credit, bool refill);
+
+uint64_t mq_publish_push(MessageQueueConnection *c, Request *r, size_t n, size_t bytes, bool async);
+Request *mq_publish_frame(const char *topic, const char **bodies, size_t n, size_t *bytes);
+Request *mq_request(const char *method, const char *body, size_t length, const char *format, ...) __attribute__((format(printf, 4, 5)));
+void mq_ack(MessageQueueConnection *c, uint64_t ticket, int status);
+void mq_ack_flush(MessageQueueConnection *c);
+void mq_abandon(MessageQueueConnection *c);
+void mq_drop(MessageQueueConnection *c, Request *r);
+void mq_finished(MessageQueueConnection *c);
+
+bool mq_connection_open(MessageQueue *mq, MessageQueueConnection *c, const MessageQueueOptions *options);
+void mq_connection_close(MessageQueueConnection *c);
+MessageQueueConnection *mq_connection(MessageQueue *mq, const char *topic);
+
+MessageQueueRequestType mq_request_type(Request *r);
+size_t mq_request_max(Request *r);
+
+Request *get_response(MessageQueueConnection *c);
+ssize_t mq_stream_parse(MessageQueueConnection *c);
 
 /* External Functions */
 
@@ -29,27 +127,74 @@ Request *get_response(MessageQueue *mq);
  * @return  Newly allocated Message Queue structure.
  */
 MessageQueue *mq_create(const char *name, const char *host, const char *port) {
-    MessageQueue *mq = (MessageQueue *)malloc(sizeof(MessageQueue));
+    return mq_create_with_options(name, host, port, NULL);
+}
+
+/**
+ * Create Message Queue withs specified name, host, port, and options.
+ * @param   name        Name of client's queue.
+ * @param   host        Address of server.
+ * @param   port        Port of server.
+ * @param   options     Message Queue options (NULL for defaults).
+ * @return  Newly allocated Message Queue structure (NULL if the options
+ *          conflict or the connections cannot be opened).
+ */
+MessageQueue *mq_create_with_options(const char *name, const char *host, const char *port,
+                                     const MessageQueueOptions *options) {
+    // publishes evicted from outgoing are never answered, so they could not be acknowledged
+    if (options && options->ack_handler && options->outgoing_policy == QUEUE_DROP_OLDEST) {
+        error("Unable to acknowledge publishes with QUEUE_DROP_OLDEST");
+        return NULL;
+    }
+
+    MessageQueue *mq = (MessageQueue *)calloc(1, sizeof(MessageQueue));
 
     if (mq) {
         strcpy(mq->name, name);
         strcpy(mq->host, host);
         strcpy(mq->port, port);
 
-        mq->outgoing = queue_create();
-        mq->incoming = queue_create();
+        mq->reactor      = options && options->reactor;
+        mq->stream       = options && options->stream;
+        mq->prefetch     = options && !mq->stream ? options->prefetch : 0;
+        mq->credit       = mq->prefetch;
+        mq->nconnections = options && options->connections ? options->connections + 1 : mq->stream ? 2 : 1;
+        mq->connections  = calloc(mq->nconnections, sizeof(MessageQueueConnection));
+        mq->incoming     = queue_create();
 
         mq->shutdown = false;
-        mq->fs = socket_connect(mq->host, mq->port);
+        mutex_init(&mq->sd_lock, NULL);
 
-        int fd = fileno(mq->fs);
-        int flags = fcntl(fd, F_GETFL, 0);
-        flags |= O_NONBLOCK;
-        fcntl(fd, F_SETFL, flags);
+        // mq_stop waits on sd_cond with a deadline (on the monotonic clock)
+        pthread_condattr_t attr;
+        PTHREAD_CHECK(pthread_condattr_init(&attr));
+        PTHREAD_CHECK(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+        mq->detached = 0;
+        cond_init(&mq->sd_cond, &attr);
+        PTHREAD_CHECK(pthread_condattr_destroy(&attr));
 
-        mutex_init(&mq->sd_lock, NULL);
-        mutex_init(&mq->fs_lock, NULL);
-        cond_init(&mq->retv_cond, NULL);
+        mq->topics = NULL;
+        mutex_init(&mq->t_lock, NULL);
+
+        mq->ack_handler = options ? options->ack_handler : NULL;
+        mq->ack_arg     = options ? options->ack_arg     : NULL;
+        mq->tickets     = 0;
+
+        memset(&mq->stats, 0, sizeof(MessageQueueStats));
+
+        if (!mq->connections) {
+            mq_delete(mq);
+            return NULL;
+        }
+
+        for (size_t c = 0; c < mq->nconnections; c++) {
+            if (!mq_connection_open(mq, &mq->connections[c], options)) {
+                mq->nconnections = c + 1;
+                mq_delete(mq);
+                return NULL;
+            }
+        }
+        mq->retriever = &mq->connections[mq->nconnections - 1];
     }
 
     return mq;
@@ -61,11 +206,21 @@ MessageQueue *mq_create(const char *name, const char *host, const char *port) {
  */
 void mq_delete(MessageQueue *mq) {
     if (mq) {
-        queue_delete(mq->outgoing);
+        for (size_t c = 0; mq->connections && c < mq->nconnections; c++)
+            mq_connection_close(&mq->connections[c]);
+        free(mq->connections);
         queue_delete(mq->incoming);
+
+        for (MessageQueueTopic *t = mq->topics, *next; t; t = next) {
+            next = t->next;
+            free(t->name);
+            free(t->uri);
+            free(t->prefix);
+            free(t);
+        }
+        mutex_destroy(&mq->t_lock);
         mutex_destroy(&mq->sd_lock);
-        mutex_destroy(&mq->fs_lock);
-        cond_destroy(&mq->retv_cond);
+        cond_destroy(&mq->sd_cond);
     }
 
     free(mq);
@@ -76,40 +231,276 @@ void mq_delete(MessageQueue *mq) {
  * @param   mq      Message Queue structure.
  * @param   topic   Topic to publish to.
  * @param   body    Message body to publish.
+ * @return  Whether or not the message was queued (false if the outgoing queue
+ *          is full and its policy is QUEUE_FAIL).
+ */
+bool mq_publish(MessageQueue *mq, const char *topic, const char *body) {
+    Request *r = mq_request("PUT", body, strlen(body), "/topic/%s", topic);
+    return mq_publish_push(mq_connection(mq, topic), r, 1, strlen(body), false);
+}
+
+/**
+ * Publish batch of messages to topic as a single request whose body holds
+ * each message as a length-prefixed frame (see http_frame_append).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   bodies  Message bodies to publish.
+ * @param   n       Number of messages.
+ * @return  Whether or not the batch was queued (false if it could not be
+ *          allocated or the outgoing queue is full and its policy is QUEUE_FAIL).
+ */
+bool mq_publish_batch(MessageQueue *mq, const char *topic, const char **bodies, size_t n) {
+    size_t bytes = 0;
+
+    if (!n)
+        return true;
+
+    Request *r = mq_publish_frame(topic, bodies, n, &bytes);
+    return mq_publish_push(mq_connection(mq, topic), r, n, bytes, false);
+}
+
+/**
+ * Publish one message to topic without waiting for the broker's response,
+ * which is instead reported to the ack_handler (on the I/O thread, batched
+ * with every other acknowledgement parsed from the same read).
+ *
+ * Every ticket that is returned is acknowledged exactly once: by mq_stop at
+ * the latest (with status 0) if the request was never answered.  Publishes
+ * made after mq_stop are discarded without acknowledgement.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Message body to publish.
+ * @return  Ticket identifying the publish in its acknowledgement (0 if the
+ *          outgoing queue is full and its policy is QUEUE_FAIL).
  */
-void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
-    char uri[64];
-    sprintf(uri, "/topic/%s", topic);
-    queue_push(mq->outgoing, request_create("PUT", uri, body));
-    // check_response(mq, NULL);
+uint64_t mq_publish_async(MessageQueue *mq, const char *topic, const char *body) {
+    Request *r = mq_request("PUT", body, strlen(body), "/topic/%s", topic);
+    return mq_publish_push(mq_connection(mq, topic), r, 1, strlen(body), true);
 }
 
 /**
- * Retrieve one message (by taking Request from incoming queue).
+ * Publish batch of messages to topic as a single request without waiting for
+ * the broker's response (see mq_publish_async).
  * @param   mq      Message Queue structure.
- * @return  Newly allocated message body (must be freed).
+ * @param   topic   Topic to publish to.
+ * @param   bodies  Message bodies to publish.
+ * @param   n       Number of messages (at least one).
+ * @return  Ticket identifying the whole batch in its acknowledgement (0 if it
+ *          could not be allocated or queued).
+ */
+uint64_t mq_publish_batch_async(MessageQueue *mq, const char *topic, const char **bodies, size_t n) {
+    size_t bytes = 0;
+
+    if (!n)
+        return 0;
+
+    Request *r = mq_publish_frame(topic, bodies, n, &bytes);
+    return mq_publish_push(mq_connection(mq, topic), r, n, bytes, true);
+}
+
+/**
+ * Open handle for publishing to topic, which holds the topic's connection and
+ * the preformatted header of its publishes.  Handles are interned: opening
+ * the same topic again returns the same handle, and every handle remains
+ * valid until mq_delete.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @return  Message Queue Topic structure (NULL on allocation failure).
+ */
+MessageQueueTopic *mq_topic_open(MessageQueue *mq, const char *topic) {
+    mutex_lock(&mq->t_lock);
+
+    MessageQueueTopic *t = mq->topics;
+    while (t && !streq(t->name, topic))
+        t = t->next;
+
+    if (!t && (t = calloc(1, sizeof(MessageQueueTopic)))) {
+        t->mq         = mq;
+        t->connection = mq_connection(mq, topic);
+        t->name       = strdup(topic);
+        t->uri        = malloc(strlen("/topic/") + strlen(topic) + 1);
+        if (t->uri)
+            sprintf(t->uri, "/topic/%s", topic);
+        t->prefix     = t->uri ? request_prefix("PUT", t->uri, &t->plength) : NULL;
+
+        if (t->name && t->prefix) {
+            t->next    = mq->topics;
+            mq->topics = t;
+        } else {
+            error("Unable to allocate topic %s", topic);
+            free(t->name);
+            free(t->uri);
+            free(t);
+            t = NULL;
+        }
+    }
+
+    mutex_unlock(&mq->t_lock);
+    return t;
+}
+
+/**
+ * Publish one message to topic handle's topic (without formatting its uri or
+ * header, which are shared by every publish to the topic).
+ * @param   t       Message Queue Topic structure.
+ * @param   body    Message body to publish (need not be NUL-terminated).
+ * @param   length  Length of message body.
+ * @return  Whether or not the message was queued (false if the outgoing queue
+ *          is full and its policy is QUEUE_FAIL).
+ */
+bool mq_publish_h(MessageQueueTopic *t, const char *body, size_t length) {
+    Request *r = request_create_body("PUT", NULL, body, length);
+    if (r) {
+        r->uri     = t->uri;
+        r->prefix  = t->prefix;
+        r->plength = t->plength;
+    }
+
+    return mq_publish_push(t->connection, r, 1, length, false);
+}
+
+/**
+ * Retrieve one message (by taking Request from incoming queue, after asking
+ * the server for one unless messages are being streamed or prefetched).
+ * @param   mq      Message Queue structure.
+ * @return  Newly allocated message body (must be freed), or NULL if the
+ *          message queue was shutdown, the request could not be allocated, or
+ *          the server reported an error.
  */
 char *mq_retrieve(MessageQueue *mq) {
-    char uri[64];
-    sprintf(uri, "/queue/%s", mq->name);
-    queue_push(mq->outgoing, request_create("GET", uri, NULL));
+    if (mq_shutdown(mq))
+        return NULL;
+
+    if (!mq->stream && !mq->prefetch) {
+        Request *get = mq_request("GET", NULL, 0, "/queue/%s", mq->name);
+        if (!get)
+            return NULL;
+        queue_push(mq->retriever->outgoing, get);
+    }
+
+    Request *r = queue_pop(mq->incoming);
+    if (streq(r->method, SENTINEL)) {
+        /* Leave sentinel in place for any other waiting retrievers */
+        queue_push(mq->incoming, r);
+        return NULL;
+    }
+
+    char *body = NULL;
+    if (streq(r->method, "200")) {
+        body = strdup(r->body);
+        __atomic_fetch_add(&mq->stats.retrieved, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&mq->stats.retrieved_bytes, request_length(r), __ATOMIC_RELAXED);
+    }
+    request_delete(r);
+
+    if (mq->prefetch)
+        mq_prefetch(mq, body ? 1 : 0, true);
+    return body;
+}
+
+/**
+ * Retrieve up to max messages with a single request (by taking the first
+ * Request from incoming queue and then any others that are already there).
+ * When messages are being streamed or prefetched, no request is sent.
+ * @param   mq          Message Queue structure.
+ * @param   max         Maximum number of messages to retrieve.
+ * @param   messages    Array of at least max entries that is set to the newly
+ *                      allocated message bodies (must be freed).
+ * @return  Number of messages retrieved (0 if the message queue was shutdown,
+ *          the request could not be allocated, or the server reported an error).
+ */
+size_t mq_retrieve_many(MessageQueue *mq, size_t max, char **messages) {
+    if (!max || mq_shutdown(mq))
+        return 0;
+
+    if (!mq->stream && !mq->prefetch) {
+        Request *get = mq_request("GET", NULL, 0, "/queue/%s?max=%lu", mq->name, max);
+        if (!get)
+            return 0;
+        queue_push(mq->retriever->outgoing, get);
+    }
+
+    size_t n = 0;
+    size_t bytes = 0;
+    for (Request *r = queue_pop(mq->incoming); r; r = n < max ? queue_try_pop(mq->incoming) : NULL) {
+        if (streq(r->method, SENTINEL)) {
+            /* Leave sentinel in place for any other waiting retrievers */
+            queue_push(mq->incoming, r);
+            break;
+        }
+
+        if (streq(r->method, "200")) {
+            messages[n++] = strdup(r->body);
+            bytes += request_length(r);
+        }
+        request_delete(r);
+    }
+
+    __atomic_fetch_add(&mq->stats.retrieved, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mq->stats.retrieved_bytes, bytes, __ATOMIC_RELAXED);
+
+    if (mq->prefetch)
+        mq_prefetch(mq, n, true);
+    return n;
+}
+
+/**
+ * Consume messages by handing each to a pool of worker threads instead of
+ * retrieving them: a dispatcher thread retrieves batches of messages ahead of
+ * the workers and deals them out, with idle workers stealing from busy ones.
+ * The pool runs until mq_stop, which waits for every message already
+ * retrieved to be handled.  Messages retrieved directly by the application
+ * are not seen by the workers.
+ * @param   mq          Message Queue structure.
+ * @param   handler     Function to call with each message (concurrently).
+ * @param   arg         Passed to handler.
+ * @param   nworkers    Number of worker threads.
+ * @return  Whether or not the workers were started (false if the message
+ *          queue is already being consumed or the pool could not be allocated).
+ **/
+bool mq_consume(MessageQueue *mq, MessageQueueHandler handler, void *arg, size_t nworkers) {
+    if (mq->consumer || !handler || !nworkers)
+        return false;
+
+    MessageQueueConsumer *consumer = calloc(1, sizeof(MessageQueueConsumer));
+    ConsumerWorker *      workers  = consumer ? calloc(nworkers, sizeof(ConsumerWorker)) : NULL;
+    if (!workers) {
+        error("Unable to allocate %lu consumer workers", nworkers);
+        free(consumer);
+        return false;
+    }
 
-    char *msg;
-    mutex_lock(&mq->fs_lock);
+    consumer->mq       = mq;
+    consumer->handler  = handler;
+    consumer->arg      = arg;
+    consumer->workers  = workers;
+    consumer->nworkers = nworkers;
+    consumer->limit    = nworkers * CONSUME_BATCH;
+    mutex_init(&consumer->lock, NULL);
+    cond_init(&consumer->ready, NULL);
+    cond_init(&consumer->drained, NULL);
 
-    check_response(mq, &msg);
-    return msg;
+    for (size_t w = 0; w < nworkers; w++) {
+        workers[w].consumer = consumer;
+        workers[w].id       = w;
+        mutex_init(&workers[w].lock, NULL);
+    }
+
+    mq->consumer = consumer;
+    for (size_t w = 0; w < nworkers; w++)
+        thread_create(&workers[w].thread, NULL, mq_worker, &workers[w]);
+    thread_create(&consumer->dispatcher, NULL, mq_dispatcher, consumer);
+    return true;
 }
 
 /**
- * Subscribe to specified topic.
+ * Subscribe to specified topic (on the same connection as retrieves, so the
+ * broker has the subscription before any retrieve made after it).
  * @param   mq      Message Queue structure.
  * @param   topic   Topic string to subscribe to.
  **/
 void mq_subscribe(MessageQueue *mq, const char *topic) {
-    char uri[64];
-    sprintf(uri, "/subscription/%s/%s", mq->name, topic);
-    queue_push(mq->outgoing, request_create("PUT", uri, NULL));
+    queue_push(mq->retriever->outgoing, mq_request("PUT", NULL, 0, "/subscription/%s/%s", mq->name, topic));
 }
 
 /**
@@ -118,30 +509,53 @@ void mq_subscribe(MessageQueue *mq, const char *topic) {
  * @param   topic   Topic string to unsubscribe from.
  **/
 void mq_unsubscribe(MessageQueue *mq, const char *topic) {
-    char uri[64];
-    sprintf(uri, "/subscription/%s/%s", mq->name, topic);
-    queue_push(mq->outgoing, request_create("DELETE", uri, NULL));
-
-    // mutex_lock(&mq->fs_lock);
-    // Request * r = get_response(mq);
-    // printf("%s\n", __func__);
-    // mutex_unlock(&mq->fs_lock);
+    queue_push(mq->retriever->outgoing, mq_request("DELETE", NULL, 0, "/subscription/%s/%s", mq->name, topic));
 }
 
 /**
- * Start running the background threads:
+ * Start running the background threads for each connection:
  *  1. First thread should continuously send requests from outgoing queue.
  *  2. Second thread should continuously receive reqeusts to incoming queue.
+ *
+ * In reactor mode, the connections are instead attached to the reactor
+ * thread shared by every reactor mode message queue in the process.
+ *
+ * A streaming message queue first asks for its stream on the retriever, while
+ * a prefetching one requests its whole window.
  * @param   mq      Message Queue structure.
  */
 void mq_start(MessageQueue *mq) {
-    thread_create(&mq->pusher, NULL, mq_pusher, mq);
-    thread_create(&mq->puller, NULL, mq_puller, mq);
+    if (mq->stream)
+        queue_push(mq->retriever->outgoing, mq_request("GET", NULL, 0, "/stream/%s", mq->name));
+
+    if (mq->prefetch)
+        mq_prefetch(mq, 0, true);
+
+    if (mq->reactor) {
+        mq_reactor_attach(mq);
+        return;
+    }
+
+    for (size_t c = 0; c < mq->nconnections; c++) {
+        thread_create(&mq->connections[c].pusher, NULL, mq_pusher, &mq->connections[c]);
+        thread_create(&mq->connections[c].puller, NULL, mq_puller, &mq->connections[c]);
+    }
 }
 
 /**
  * Stop the message queue client by setting shutdown attribute and sending
- * sentinel messages
+ * sentinel messages.  Each connection sends everything queued before its
+ * sentinel and then half-closes its socket, so the broker answers every
+ * request it was sent before closing the connection.  Connections that are
+ * still waiting for answers after MQ_DRAIN_TIMEOUT seconds are cut off.
+ *
+ * Once cut off, a connection stops within a single read or send: I/O threads
+ * only ever push onto linked-list queues, so nothing but an ack_handler that
+ * blocks (which is reported every MQ_DRAIN_TIMEOUT seconds) can hold them up.
+ *
+ * Once every connection has stopped, any asynchronous publishes that were
+ * never answered are acknowledged with status 0 and any consumer workers
+ * finish the messages they were dealt.
  * @param   mq      Message Queue structure.
  */
 void mq_stop(MessageQueue *mq) {
@@ -150,11 +564,49 @@ void mq_stop(MessageQueue *mq) {
     mutex_unlock(&mq->sd_lock);
 
     // send sentinel messages
-    queue_push(mq->outgoing, request_create(SENTINEL, NULL, NULL));
+    for (size_t c = 0; c < mq->nconnections; c++)
+        queue_push(mq->connections[c].outgoing, request_create(SENTINEL, NULL, NULL));
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += MQ_DRAIN_TIMEOUT;
+
+    // wait for each connection to finish (or cut off those still waiting,
+    // which unblocks any puller stuck on a long-poll GET)
+    bool cutoff = false;
+    mutex_lock(&mq->sd_lock);
+    while (mq->detached < mq->nconnections) {
+        int rc = pthread_cond_timedwait(&mq->sd_cond, &mq->sd_lock, &deadline);
+        if (rc != ETIMEDOUT) {
+            PTHREAD_CHECK(rc);
+            continue;
+        }
+
+        if (!cutoff) {
+            for (size_t c = 0; c < mq->nconnections; c++)
+                shutdown(mq->connections[c].fd, SHUT_RDWR);
+            cutoff = true;
+        } else {
+            error("Still waiting for %lu connections to stop (is ack_handler blocked?)",
+                  mq->nconnections - mq->detached);
+        }
+        deadline.tv_sec += MQ_DRAIN_TIMEOUT;
+    }
+    mutex_unlock(&mq->sd_lock);
+
+    if (mq->reactor) {
+        mq_reactor_release();
+    } else {
+        for (size_t c = 0; c < mq->nconnections; c++) {
+            thread_join(mq->connections[c].pusher, NULL);
+            thread_join(mq->connections[c].puller, NULL);
+        }
+    }
+
+    for (size_t c = 0; c < mq->nconnections; c++)
+        mq_abandon(&mq->connections[c]);
 
-    thread_join(mq->pusher, NULL);
-    thread_join(mq->puller, NULL);
-    printf("stop\n");
+    mq_consumer_stop(mq);
 }
 
 /**
@@ -169,103 +621,1100 @@ bool mq_shutdown(MessageQueue *mq) {
     return res;
 }
 
+/**
+ * Take snapshot of message queue's statistics (without locking, so counters
+ * may be updated while they are copied).
+ * @param   mq      Message Queue structure.
+ * @param   stats   Message Queue Stats structure to copy into.
+ */
+void mq_stats(MessageQueue *mq, MessageQueueStats *stats) {
+    stats->published       = __atomic_load_n(&mq->stats.published,       __ATOMIC_RELAXED);
+    stats->published_bytes = __atomic_load_n(&mq->stats.published_bytes, __ATOMIC_RELAXED);
+    stats->retrieved       = __atomic_load_n(&mq->stats.retrieved,       __ATOMIC_RELAXED);
+    stats->retrieved_bytes = __atomic_load_n(&mq->stats.retrieved_bytes, __ATOMIC_RELAXED);
+
+    stats->incoming = __atomic_load_n(&mq->incoming->size, __ATOMIC_RELAXED);
+    stats->outgoing = stats->pending = 0;
+    stats->outgoing_bytes = stats->outgoing_peak = stats->outgoing_peak_bytes = 0;
+    stats->dropped = stats->rejected = 0;
+    stats->acked   = 0;
+
+    for (size_t c = 0; c < mq->nconnections; c++) {
+        Queue *outgoing = mq->connections[c].outgoing;
+
+        stats->outgoing            += __atomic_load_n(&outgoing->size,       __ATOMIC_RELAXED);
+        stats->pending             += __atomic_load_n(&mq->connections[c].pending->size, __ATOMIC_RELAXED);
+        stats->outgoing_bytes      += __atomic_load_n(&outgoing->bytes,      __ATOMIC_RELAXED);
+        stats->outgoing_peak       += __atomic_load_n(&outgoing->peak_size,  __ATOMIC_RELAXED);
+        stats->outgoing_peak_bytes += __atomic_load_n(&outgoing->peak_bytes, __ATOMIC_RELAXED);
+        stats->dropped             += __atomic_load_n(&outgoing->dropped,    __ATOMIC_RELAXED);
+        stats->rejected            += __atomic_load_n(&outgoing->rejected,   __ATOMIC_RELAXED);
+    }
+
+    // each connection's response counters have a single writer (its puller
+    // or the reactor), so they are snapshotted separately and summed
+    for (size_t t = 0; t < MQ_REQUEST_TYPES; t++) {
+        stats->responses[t] = stats->errors[t] = 0;
+        histogram_init(&stats->rtt[t]);
+    }
+
+    for (size_t c = 0; c < mq->nconnections; c++) {
+        MessageQueueConnection *connection = &mq->connections[c];
+        Histogram rtt;
+
+        stats->acked += __atomic_load_n(&connection->acked, __ATOMIC_RELAXED);
+        for (size_t t = 0; t < MQ_REQUEST_TYPES; t++) {
+            stats->responses[t] += __atomic_load_n(&connection->responses[t], __ATOMIC_RELAXED);
+            stats->errors[t]    += __atomic_load_n(&connection->errors[t],    __ATOMIC_RELAXED);
+            histogram_snapshot(&rtt, &connection->rtt[t]);
+            histogram_merge(&stats->rtt[t], &rtt);
+        }
+    }
+}
+
 /* Internal Functions */
 
 /**
  * Pusher thread takes messages from outgoing queue and sends them to server.
+ *
+ * Requests are pipelined: the pusher never waits for a response.  Instead,
+ * each request is recorded in the pending queue (in the same order it is
+ * written) so the puller can route the corresponding response.  Requests that
+ * are already waiting in the outgoing queue are popped with a single lock
+ * acquisition and sent with a single syscall.
  **/
 void *mq_pusher(void *arg) {
-    MessageQueue *mq = (MessageQueue *)arg;
-    Request *r;
+    MessageQueueConnection *c = (MessageQueueConnection *)arg;
+    Request *batch[MQ_BATCH];
+    Request *unsent = NULL;
+    Buffer headers;
+    bool running = true;
 
-    while (!mq_shutdown(mq)) {
-        // takes message
-        printf("start\n");
-        r = queue_pop(mq->outgoing);
+    buffer_init(&headers);
+    while (running) {
+        // take everything that is ready (up to a batch) and send it together
+        size_t n = queue_pop_batch(c->outgoing, batch, MQ_BATCH);
 
-        if (streq(r->method, SENTINEL))
-            break;
+        for (size_t i = 0; i < n; i++) {
+            if (streq(batch[i]->method, SENTINEL)) {
+                // requests queued after the sentinel are never sent (they are
+                // left behind the sentinel in pending for mq_abandon)
+                request_delete(batch[i]);
+                for (size_t j = i + 1; j < n; j++)
+                    batch[j]->next = j + 1 < n ? batch[j + 1] : NULL;
+                unsent  = i + 1 < n ? batch[i + 1] : NULL;
+                running = false;
+                n = i;
+                break;
+            }
+        }
 
-        // send to server
-        mutex_lock(&mq->fs_lock);
-        printf("send\n");
-        request_write(r, mq->fs);
-        printf("%s %s\n", r->method, r->uri);
-        if (!streq(r->method, "GET")) {
-            printf("get response\n");
-            Request * resp = get_response(mq);
-            printf("body: %s\n", resp->body);
-            request_delete(resp);
-        } else {
-            cond_signal(&mq->retv_cond);
+        uint64_t now = histogram_timestamp();
+        for (size_t i = 0; i < n; i++) {
+            batch[i]->timestamp = now;
+            batch[i]->next      = i + 1 < n ? batch[i + 1] : NULL;
+        }
+        if (n)
+            queue_push_all(c->pending, batch[0]);
+
+        if (n && !request_send(batch, n, &headers, c->fd)) {
+            error("Unable to send requests: %s", strerror(errno));
+            break;
         }
-        mutex_unlock(&mq->fs_lock);
-        request_delete(r);
-        printf("end\n");
     }
 
+    buffer_free(&headers);
+    queue_push(c->pending, request_create(SENTINEL, NULL, NULL));
+    queue_push_all(c->pending, unsent);
+
+    // nothing more will be sent, so the broker closes once it has answered
+    shutdown(c->fd, SHUT_WR);
     return NULL;
 }
 
 /**
- * Puller thread requests new messages from server and then puts them in
- * incoming queue.
+ * Puller thread receives responses from server and routes them according to
+ * the pending request they answer: GET responses are placed in the incoming
+ * queue while acknowledgements of other requests are discarded.  Once a
+ * streaming response starts, its messages are parsed into the incoming queue
+ * as they arrive until the stream ends.
  **/
 void *mq_puller(void *arg) {
-    MessageQueue *mq = (MessageQueue *)arg;
+    MessageQueueConnection *c = (MessageQueueConnection *)arg;
     Request *r;
 
-    char buffer[512];
-    char http[64];
-    char code[64];
-    char code_msg[64];
+    while (true) {
+        if (c->streaming) {
+            if (mq_stream_parse(c) < 0 || (c->streaming && buffer_read(&c->rbuffer, c->fd) <= 0))
+                break;
+            continue;
+        }
 
-    while (!mq_shutdown(mq)) {
-        mutex_lock(&mq->fs_lock);
+        r = queue_pop(c->pending);
 
-        cond_wait(&mq->retv_cond, &mq->fs_lock);
-        
-        r = get_response(mq);
-        // put into queue
-        if (r) {
-            printf("incoming %s\n", r->method);
-            queue_push(mq->incoming, r);
+        if (streq(r->method, SENTINEL)) {
+            request_delete(r);
+            break;
+        }
+
+        Request *response = get_response(c);
+        if (!response) {
+            mq_drop(c, r);
+            break;
         }
-        r = NULL;
-        mutex_unlock(&mq->fs_lock);
+
+        mq_route(c, r, response);
     }
 
+    mq_ack_flush(c);
+    mq_finished(c);
     return NULL;
 }
 
-/* my aux-function */
-void check_response(MessageQueue *mq, char **body) {
-    Request *r = queue_pop(mq->incoming);
+/**
+ * Route response according to the request it answers: GET responses are
+ * placed in the incoming queue while acknowledgements are discarded (after
+ * recording the status of any asynchronous publish).  The framed batch
+ * answering a GET with a maximum is split into one Request per message, which
+ * are all placed in the incoming queue at once.  The header of a stream is
+ * discarded (its messages follow as chunks).  Whatever part of a prefetch
+ * window the response did not fill is returned as credit.
+ *
+ * The round-trip time and status of each response are recorded in the
+ * message queue's statistics (only the I/O thread writes these).
+ * @param   c           Message Queue Connection structure request was sent on.
+ * @param   r           Request that was sent (deleted).
+ * @param   response    Response to request.
+ **/
+void mq_route(MessageQueueConnection *c, Request *r, Request *response) {
+    MessageQueue *mq = c->mq;
+    MessageQueueRequestType type = mq_request_type(r);
+    size_t max = mq_request_max(r);
 
-    if (streq(r->method, "200"))
-        printf("OK\n");
-    else
-        printf("%s\n", r->uri);
+    __atomic_store_n(&c->responses[type], c->responses[type] + 1, __ATOMIC_RELAXED);
+    if (!streq(response->method, "200"))
+        __atomic_store_n(&c->errors[type], c->errors[type] + 1, __ATOMIC_RELAXED);
+    if (r->timestamp)
+        histogram_record(&c->rtt[type], histogram_timestamp() - r->timestamp);
+    if (r->ticket)
+        mq_ack(c, r->ticket, atoi(response->method));
 
-    if (body)
-        *body = strdup(r->body);
+    if (!streq(r->method, "GET") || (streq(response->method, "200") && strncmp(r->uri, "/stream/", 8) == 0)) {
+        request_delete(response);
+    } else if (streq(response->method, "200") && max) {
+        Request *head = mq_unframe(response);
+        if (mq->prefetch) {
+            size_t n = 0;
+            for (Request *m = head; m && streq(m->method, "200"); m = m->next)
+                n++;
+            // an unparsable batch holds no credit (it refills once retrieved)
+            mq_prefetch(mq, n < max ? max - n : 0, n > 0);
+        }
+        queue_push_all(mq->incoming, head);
+        request_delete(response);
+    } else {
+        // an error holds no credit, but refills only once retrieved
+        if (mq->prefetch && max)
+            mq_prefetch(mq, max, false);
+        queue_push(mq->incoming, response);
+    }
     request_delete(r);
 }
 
-Request *get_response(MessageQueue *mq) {
-    char buffer[512];
-    Request * r;
+/**
+ * Queue publish request on the connection for its topic, assigning it a
+ * ticket if it is asynchronous.
+ * @param   c           Message Queue Connection structure for topic.
+ * @param   r           Publish request (deleted if it is not queued).
+ * @param   n           Number of messages in request.
+ * @param   bytes       Bytes of message bodies in request.
+ * @param   async       Whether or not the response should be acknowledged.
+ * @return  Ticket of asynchronous request (otherwise 1) or 0 if the request
+ *          was not queued.
+ **/
+uint64_t mq_publish_push(MessageQueueConnection *c, Request *r, size_t n, size_t bytes, bool async) {
+    MessageQueue *mq = c->mq;
+
+    if (!r)
+        return 0;
+
+    if (async)
+        r->ticket = __atomic_add_fetch(&mq->tickets, 1, __ATOMIC_RELAXED);
+
+    uint64_t ticket = async ? r->ticket : 1;
+    if (!queue_push(c->outgoing, r)) {
+        request_delete(r);
+        return 0;
+    }
+
+    __atomic_fetch_add(&mq->stats.published, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mq->stats.published_bytes, bytes, __ATOMIC_RELAXED);
+    return ticket;
+}
+
+/**
+ * Create publish request whose body holds each message as a length-prefixed
+ * frame (see http_frame_append).
+ * @param   topic       Topic to publish to.
+ * @param   bodies      Message bodies to publish.
+ * @param   n           Number of messages.
+ * @param   bytes       Set to the number of bytes of message bodies.
+ * @return  Newly allocated Request structure (NULL on allocation failure).
+ **/
+Request *mq_publish_frame(const char *topic, const char **bodies, size_t n, size_t *bytes) {
+    Buffer batch;
+
+    buffer_init(&batch);
+    for (size_t i = 0; i < n; i++) {
+        size_t length = strlen(bodies[i]);
+        if (!http_frame_append(&batch, bodies[i], length)) {
+            error("Unable to allocate batch of %lu messages", n);
+            buffer_free(&batch);
+            return NULL;
+        }
+        *bytes += length;
+    }
+
+    Request *r = mq_request("PUT", buffer_head(&batch), buffer_length(&batch), "/topic/%s?batch=%lu", topic, n);
+    buffer_free(&batch);
+    return r;
+}
+
+/**
+ * Create request whose uri is formatted (into a buffer on the stack unless it
+ * is longer than BUFSIZ, so names of any length are safe).
+ * @param   method      Request method string.
+ * @param   body        Request body bytes (NULL for none).
+ * @param   length      Length of request body.
+ * @param   format      Format string for uri.
+ * @return  Newly allocated Request structure (NULL on allocation failure).
+ **/
+Request *mq_request(const char *method, const char *body, size_t length, const char *format, ...) {
+    char    buffer[BUFSIZ];
+    char *  uri = buffer;
+    va_list args;
 
-    while (!fgets(buffer, 512, mq->fs))
-        continue;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
 
-    while (fgets(buffer, 512, mq->fs) && !streq(buffer, "\r\n")) {
-        continue;
+    if (n < 0)
+        return NULL;
+
+    if ((size_t)n >= sizeof(buffer)) {
+        if (!(uri = malloc(n + 1)))
+            return NULL;
+        va_start(args, format);
+        vsnprintf(uri, n + 1, format, args);
+        va_end(args);
     }
-    char *succ = fgets(buffer, 512, mq->fs);
-    r = request_create(NULL, NULL, buffer);
 
+    Request *r = request_create_body(method, uri, body, length);
+    if (uri != buffer)
+        free(uri);
     return r;
 }
 
+/**
+ * Record acknowledgement of asynchronous publish, delivering the batch of
+ * waiting acknowledgements if it is full.
+ * @param   c           Message Queue Connection structure publish was sent on.
+ * @param   ticket      Ticket of publish.
+ * @param   status      Status of broker's response (0 if never answered).
+ **/
+void mq_ack(MessageQueueConnection *c, uint64_t ticket, int status) {
+    __atomic_store_n(&c->acked, c->acked + 1, __ATOMIC_RELAXED);
+    if (!c->acks)
+        return;
+
+    c->acks[c->nacks].ticket = ticket;
+    c->acks[c->nacks].status = status;
+    if (++c->nacks == MQ_BATCH)
+        mq_ack_flush(c);
+}
+
+/**
+ * Deliver waiting acknowledgements to the message queue's ack_handler.
+ * @param   c           Message Queue Connection structure.
+ **/
+void mq_ack_flush(MessageQueueConnection *c) {
+    if (c->nacks) {
+        c->mq->ack_handler(c->mq, c->acks, c->nacks, c->mq->ack_arg);
+        c->nacks = 0;
+    }
+}
+
+/**
+ * Discard every request the stopped connection never sent or never received
+ * a response to, acknowledging asynchronous publishes with status 0.
+ * @param   c           Message Queue Connection structure.
+ **/
+void mq_abandon(MessageQueueConnection *c) {
+    Queue *queues[] = { c->pending, c->outgoing };
+
+    for (size_t q = 0; q < sizeof(queues) / sizeof(queues[0]); q++) {
+        for (Request *r; (r = queue_try_pop(queues[q])); )
+            mq_drop(c, r);
+    }
+
+    mq_ack_flush(c);
+}
+
+/**
+ * Delete request that will never be answered, acknowledging it with status 0
+ * if it is an asynchronous publish (only the thread that routes responses on
+ * the connection may do so, as it owns the batch of acknowledgements).
+ * @param   c           Message Queue Connection structure request was queued on.
+ * @param   r           Request structure.
+ **/
+void mq_drop(MessageQueueConnection *c, Request *r) {
+    if (r->ticket)
+        mq_ack(c, r->ticket, 0);
+    request_delete(r);
+}
+
+/**
+ * Record that connection has stopped receiving responses, waking up any
+ * retrievers if it is the retriever and then mq_stop (which may free the
+ * connection as soon as every connection of its message queue is finished).
+ * @param   c           Message Queue Connection structure.
+ **/
+void mq_finished(MessageQueueConnection *c) {
+    MessageQueue *mq = c->mq;
+
+    if (c == mq->retriever)
+        queue_push(mq->incoming, request_create(SENTINEL, NULL, NULL));
+
+    mutex_lock(&mq->sd_lock);
+    mq->detached++;
+    cond_signal(&mq->sd_cond);
+    mutex_unlock(&mq->sd_lock);
+}
+
+/**
+ * Return credit to the message queue's prefetch window and, if at least half
+ * the window is free, request that many more messages on the retriever.
+ * Every message requested or waiting in the incoming queue holds one credit,
+ * so incoming never holds more than the window.
+ * @param   mq          Message Queue structure.
+ * @param   credit      Number of messages no longer requested or waiting.
+ * @param   refill      Whether or not to request more messages.
+ **/
+void mq_prefetch(MessageQueue *mq, size_t credit, bool refill) {
+    size_t available = __atomic_add_fetch(&mq->credit, credit, __ATOMIC_ACQ_REL);
+
+    while (refill && available >= (mq->prefetch + 1) / 2) {
+        if (__atomic_compare_exchange_n(&mq->credit, &available, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // bypass any limit on outgoing, which is never a ring when
+            // prefetching (the I/O thread must not block)
+            Request *get = mq_request("GET", NULL, 0, "/queue/%s?max=%lu", mq->name, available);
+            if (get)
+                queue_push_all(mq->retriever->outgoing, get);
+            else    // keep the credit for a later refill to ask for
+                __atomic_add_fetch(&mq->credit, available, __ATOMIC_ACQ_REL);
+            return;
+        }
+    }
+}
+
+/**
+ * Split framed batch response into list of message Requests.
+ * @param   response    Response with length-prefixed frames as its body.
+ * @return  List of Requests linked by next (a single error Request if the
+ *          batch is empty or malformed).
+ **/
+Request *mq_unframe(Request *response) {
+    const char *data   = response->body;
+    size_t      length = request_length(response);
+    Request *   head   = NULL;
+    Request **  tail   = &head;
+
+    while (length) {
+        const char *frame;
+        size_t      flength;
+        ssize_t     n = http_frame_next(data, length, &frame, &flength);
+
+        if (n < 0 || !(*tail = request_create_body("200", "OK", frame, flength)))
+            break;
+
+        tail    = &(*tail)->next;
+        data   += n;
+        length -= n;
+    }
+
+    if (!head || length) {
+        error("Unable to parse batch of messages");
+        for (Request *next; head; head = next) {
+            next = head->next;
+            request_delete(head);
+        }
+        return request_create("500", http_reason(500), NULL);
+    }
+
+    return head;
+}
+
+/**
+ * Parse every complete chunk of the streaming response in the connection's
+ * read buffer, placing the messages (length-prefixed frames, which never
+ * span chunks) of each in the incoming queue at once.  The last chunk ends
+ * the stream.
+ * @param   c           Message Queue Connection structure.
+ * @return  Number of bytes consumed (-1 if the stream is malformed).
+ **/
+ssize_t mq_stream_parse(MessageQueueConnection *c) {
+    ssize_t consumed = 0;
+
+    while (c->streaming && buffer_length(&c->rbuffer)) {
+        const char *chunk;
+        size_t      clength;
+        ssize_t     n = http_chunk_next(buffer_head(&c->rbuffer), buffer_length(&c->rbuffer), &chunk, &clength);
+
+        if (n == 0)
+            break;
+        if (n < 0) {
+            error("Unable to parse stream from %s:%s", c->mq->host, c->mq->port);
+            return -1;
+        }
+
+        Request *head = NULL;
+        Request **tail = &head;
+        for (size_t offset = 0; offset < clength; ) {
+            const char *frame;
+            size_t      flength;
+            ssize_t     f = http_frame_next(chunk + offset, clength - offset, &frame, &flength);
+
+            if (f < 0 || !(*tail = request_create_body("200", "OK", frame, flength))) {
+                error("Unable to parse stream from %s:%s", c->mq->host, c->mq->port);
+                for (Request *next; head; head = next) {
+                    next = head->next;
+                    request_delete(head);
+                }
+                return -1;
+            }
+
+            tail    = &(*tail)->next;
+            offset += f;
+        }
+
+        if (head)
+            queue_push_all(c->mq->incoming, head);
+        if (!clength)
+            c->streaming = false;
+
+        buffer_consume(&c->rbuffer, n);
+        consumed += n;
+    }
+
+    return consumed;
+}
+
+/**
+ * Classify request for statistics.
+ * @param   r           Request structure.
+ * @return  Type of request.
+ **/
+MessageQueueRequestType mq_request_type(Request *r) {
+    if (streq(r->method, "GET"))
+        return MQ_REQUEST_RETRIEVE;
+    if (strncmp(r->uri, "/topic/", 7) == 0)
+        return MQ_REQUEST_PUBLISH;
+    return MQ_REQUEST_SUBSCRIPTION;
+}
+
+/**
+ * Parse number of messages asked for by a batched retrieve.
+ * @param   r           Request structure.
+ * @return  Value of the ?max= query parameter (0 if it has none).
+ **/
+size_t mq_request_max(Request *r) {
+    const char *max = strstr(r->uri, "?max=");
+    return max ? strtoul(max + 5, NULL, 10) : 0;
+}
+
+/**
+ * Connect to server and initialize connection state.
+ * @param   mq          Message Queue structure that owns connection.
+ * @param   c           Message Queue Connection structure (zeroed).
+ * @param   options     Message Queue options (NULL for defaults).
+ * @return  Whether or not the connection was opened (it must still be closed
+ *          with mq_connection_close either way).
+ **/
+bool mq_connection_open(MessageQueue *mq, MessageQueueConnection *c, const MessageQueueOptions *options) {
+    c->mq  = mq;
+    c->fd  = socket_connect(mq->host, mq->port);
+    c->efd = -1;
+
+    buffer_init(&c->rbuffer);
+    buffer_init(&c->wbuffer);
+    http_parser_init(&c->parser);
+
+    // the I/O thread refills the prefetch window on the retriever's outgoing,
+    // so that one must not be a ring (which could block it)
+    bool refilled = mq->prefetch && c == &mq->connections[mq->nconnections - 1];
+
+    if (options && options->ring_capacity && !refilled)
+        c->outgoing = queue_create_ring(options->ring_capacity);
+    else if (options && (options->max_outgoing || options->max_outgoing_bytes))
+        c->outgoing = queue_create_bounded(options->max_outgoing, options->max_outgoing_bytes,
+                                           options->outgoing_policy);
+    else
+        c->outgoing = queue_create();
+    // the I/O thread must never block recording sent requests (a whole batch
+    // is recorded before it is sent, and only responses to sent requests
+    // drain pending), so pending queues are always linked lists
+    c->pending = queue_create();
+
+    c->streaming  = false;
+    c->events     = 0;
+    c->stopping   = false;
+    c->halfclosed = false;
+    c->dnext      = NULL;
+
+    c->acks  = mq->ack_handler ? malloc(MQ_BATCH * sizeof(MessageQueueAck)) : NULL;
+    c->nacks = 0;
+
+    c->acked = 0;
+    for (size_t t = 0; t < MQ_REQUEST_TYPES; t++) {
+        c->responses[t] = c->errors[t] = 0;
+        histogram_init(&c->rtt[t]);
+    }
+
+    if (c->fd < 0 || !c->outgoing || !c->pending || (mq->ack_handler && !c->acks))
+        return false;
+
+    if (mq->reactor) {
+        int flags = fcntl(c->fd, F_GETFL);
+        if (flags < 0 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+            (c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            error("Unable to setup reactor socket: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    c->outgoing->notify = c->efd;
+    return true;
+}
+
+/**
+ * Release connection resources.
+ * @param   c           Message Queue Connection structure.
+ **/
+void mq_connection_close(MessageQueueConnection *c) {
+    queue_delete(c->outgoing);
+    queue_delete(c->pending);
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->efd >= 0)
+        close(c->efd);
+    buffer_free(&c->rbuffer);
+    buffer_free(&c->wbuffer);
+    free(c->acks);
+}
+
+/**
+ * Select connection for requests about topic: topics are hashed (FNV-1a)
+ * across every connection but the one dedicated to retrieves, so requests
+ * about a topic stay in order.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic of request.
+ * @return  Message Queue Connection structure.
+ **/
+MessageQueueConnection *mq_connection(MessageQueue *mq, const char *topic) {
+    if (mq->nconnections == 1)
+        return mq->connections;
+
+    uint64_t h = 14695981039346656037ULL;
+    while (*topic) {
+        h ^= (unsigned char)*topic++;
+        h *= 1099511628211ULL;
+    }
+    return &mq->connections[h % (mq->nconnections - 1)];
+}
+
+/**
+ * Read one HTTP response from the server:
+ *
+ *  HTTP/1.x $STATUS $REASON\r\n
+ *  Content-Length: Length($BODY)\r\n
+ *  ...\r\n
+ *  \r\n
+ *  $BODY
+ *
+ * Responses are parsed incrementally out of the connection's read buffer, so
+ * a single read may satisfy many calls and bodies may be of any size.  The
+ * socket is blocking, so waiting for data does not spin.  A chunked response
+ * is returned as soon as its header arrives and starts the connection
+ * streaming.  Acknowledgements of responses routed so far are delivered
+ * before waiting for more data.
+ *
+ * @param   c       Message Queue Connection structure.
+ * @return  Newly allocated Request structure with the status code as the
+ *          method, the reason as the uri, and the response body (or NULL if
+ *          the connection was closed).
+ **/
+Request *get_response(MessageQueueConnection *c) {
+    while (true) {
+        if (buffer_length(&c->rbuffer)) {
+            Request *r = NULL;
+            int flags  = 0;
+            ssize_t n  = http_parse_response(&c->parser, buffer_head(&c->rbuffer), buffer_length(&c->rbuffer), &r, &flags);
+
+            if (n > 0) {
+                buffer_consume(&c->rbuffer, n);
+                c->streaming = flags & HTTP_CHUNKED;
+                return r;
+            }
+
+            if (n < 0) {
+                error("Unable to parse response from %s:%s", c->mq->host, c->mq->port);
+                return NULL;
+            }
+        }
+
+        mq_ack_flush(c);
+        if (buffer_read(&c->rbuffer, c->fd) <= 0)
+            return NULL;
+    }
+}
+
+/* Reactor Functions */
+
+/**
+ * Attach message queue to the shared reactor (starting the reactor thread if
+ * this is the first message queue to use it).  Both the socket and the
+ * outgoing queue's eventfd of each connection are registered with the
+ * reactor's event loop.
+ * @param   mq      Message Queue structure.
+ **/
+void mq_reactor_attach(MessageQueue *mq) {
+    mutex_lock(&ReactorLock);
+
+    if (TheReactor.users++ == 0) {
+        TheReactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+        TheReactor.efd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = 0 };
+        if (TheReactor.epfd < 0 || TheReactor.efd < 0 ||
+            epoll_ctl(TheReactor.epfd, EPOLL_CTL_ADD, TheReactor.efd, &event) < 0) {
+            error("Unable to create reactor: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        thread_create(&TheReactor.thread, NULL, mq_reactor, &TheReactor);
+    }
+
+    for (size_t i = 0; i < mq->nconnections; i++) {
+        MessageQueueConnection *c = &mq->connections[i];
+
+        c->events = EPOLLIN;
+        struct epoll_event sevent = { .events = c->events, .data.u64 = (uintptr_t)c };
+        struct epoll_event qevent = { .events = EPOLLIN,   .data.u64 = (uintptr_t)c | REACTOR_WAKEUP };
+        if (epoll_ctl(TheReactor.epfd, EPOLL_CTL_ADD, c->fd,  &sevent) < 0 ||
+            epoll_ctl(TheReactor.epfd, EPOLL_CTL_ADD, c->efd, &qevent) < 0) {
+            error("Unable to attach to reactor: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    mutex_unlock(&ReactorLock);
+
+    // requests queued before starting did not wake anyone
+    uint64_t one = 1;
+    for (size_t i = 0; i < mq->nconnections; i++) {
+        if (write(mq->connections[i].efd, &one, sizeof(one)) < 0)
+            error("Unable to wake reactor: %s", strerror(errno));
+    }
+}
+
+/**
+ * Release reference to the shared reactor (stopping the reactor thread once
+ * no message queues are attached).
+ **/
+void mq_reactor_release() {
+    mutex_lock(&ReactorLock);
+
+    if (--TheReactor.users == 0) {
+        uint64_t one = 1;
+        if (write(TheReactor.efd, &one, sizeof(one)) < 0)
+            error("Unable to stop reactor: %s", strerror(errno));
+        thread_join(TheReactor.thread, NULL);
+
+        close(TheReactor.epfd);
+        close(TheReactor.efd);
+        TheReactor.epfd = TheReactor.efd = -1;
+    }
+
+    mutex_unlock(&ReactorLock);
+}
+
+/**
+ * Format every request waiting in the outgoing queue into the write buffer
+ * (recording each in the pending queue) until the sentinel is reached.
+ * @param   c       Message Queue Connection structure.
+ * @return  Whether or not the requests were formatted.
+ **/
+static bool mq_reactor_send(MessageQueueConnection *c) {
+    uint64_t count;
+    if (read(c->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return false;
+
+    if (c->stopping)
+        return true;
+
+    // a ring's size counts pushers still waiting for room, so it is only
+    // drained of what has actually been pushed
+    Request *head = queue_try_pop_all(c->outgoing);
+    Request *tail = NULL;
+    uint64_t now  = histogram_timestamp();
+    Request *r    = head;
+
+    for (; r && !streq(r->method, SENTINEL); tail = r, r = r->next) {
+        if (!request_format(r, &c->wbuffer, true) ||
+            (r->body && !buffer_append(&c->wbuffer, r->body, request_length(r))))
+            break;
+        r->timestamp = now;
+    }
+
+    if (tail) {
+        tail->next = NULL;
+        queue_push_all(c->pending, head);
+    }
+
+    // requests queued after the sentinel (or that could not be formatted)
+    // are never sent
+    bool formatted = !r || streq(r->method, SENTINEL);
+    c->stopping   = r != NULL && formatted;
+    for (Request *next; r; r = next) {
+        next = r->next;
+        mq_drop(c, r);
+    }
+
+    return formatted;
+}
+
+/**
+ * Read available bytes from the socket and route each complete response
+ * (delivering their acknowledgements together).
+ * @param   c       Message Queue Connection structure.
+ * @return  Whether or not the connection is still usable.
+ **/
+static bool mq_reactor_receive(MessageQueueConnection *c) {
+    ssize_t n = buffer_read(&c->rbuffer, c->fd);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return false;
+
+    while (buffer_length(&c->rbuffer)) {
+        Request *response = NULL;
+        int flags = 0;
+
+        if (c->streaming) {
+            if ((n = mq_stream_parse(c)) < 0)
+                return false;
+            if (c->streaming)
+                break;
+            continue;
+        }
+
+        n = http_parse_response(&c->parser, buffer_head(&c->rbuffer), buffer_length(&c->rbuffer), &response, &flags);
+        if (n == 0)
+            break;
+
+        if (n < 0 || c->pending->size == 0) {
+            error("Unable to parse response from %s:%s", c->mq->host, c->mq->port);
+            request_delete(response);
+            return false;
+        }
+
+        buffer_consume(&c->rbuffer, n);
+        c->streaming = flags & HTTP_CHUNKED;
+        mq_route(c, queue_pop(c->pending), response);
+    }
+
+    mq_ack_flush(c);
+    return true;
+}
+
+/**
+ * Handle readiness of connection's socket or outgoing eventfd.
+ * @param   c       Message Queue Connection structure.
+ * @param   wakeup  Whether or not the outgoing eventfd is ready.
+ * @param   events  Ready events.
+ * @return  Whether or not the connection should remain attached.
+ **/
+static bool mq_reactor_handle(MessageQueueConnection *c, bool wakeup, uint32_t events) {
+    if (wakeup) {
+        if (!mq_reactor_send(c)) {
+            error("Unable to format requests: %s", strerror(errno));
+            return false;
+        }
+    } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (!mq_reactor_receive(c))
+            return false;
+    }
+
+    if (buffer_write(&c->wbuffer, c->fd) < 0) {
+        error("Unable to send requests: %s", strerror(errno));
+        return false;
+    }
+
+    // once everything before the sentinel is sent, half-close the socket and
+    // detach only when every request has been answered (the broker closes
+    // the connection after answering, which mq_reactor_receive reports)
+    if (c->stopping && !buffer_length(&c->wbuffer)) {
+        if (!c->pending->size)
+            return false;
+        if (!c->halfclosed && shutdown(c->fd, SHUT_WR) < 0)
+            return false;
+        c->halfclosed = true;
+    }
+
+    uint32_t interest = EPOLLIN | (buffer_length(&c->wbuffer) ? EPOLLOUT : 0);
+    if (interest != c->events) {
+        struct epoll_event event = { .events = interest, .data.u64 = (uintptr_t)c };
+        epoll_ctl(TheReactor.epfd, EPOLL_CTL_MOD, c->fd, &event);
+        c->events = interest;
+    }
+
+    return true;
+}
+
+/**
+ * Reactor thread multiplexes the sockets and outgoing queues of all attached
+ * connections: requests are written when queue_push signals the outgoing
+ * eventfd and responses are routed as soon as they are parsed.
+ *
+ * Connections that stop (or fail) are detached only after the current batch
+ * of events has been handled, since mq_stop may free them as soon as every
+ * connection of their message queue is signalled.
+ **/
+void *mq_reactor(void *arg) {
+    Reactor *reactor = (Reactor *)arg;
+    struct epoll_event events[REACTOR_EVENTS];
+    bool running = true;
+
+    while (running) {
+        int n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Unable to wait for events: %s", strerror(errno));
+            break;
+        }
+
+        MessageQueueConnection *detached = NULL;
+        for (int e = 0; e < n; e++) {
+            uintptr_t tag = events[e].data.u64;
+            if (!tag) {
+                running = false;
+                continue;
+            }
+
+            MessageQueueConnection *c = (MessageQueueConnection *)(tag & ~(uintptr_t)REACTOR_WAKEUP);
+            if (!c->events)
+                continue;
+
+            if (!mq_reactor_handle(c, tag & REACTOR_WAKEUP, events[e].events)) {
+                epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, c->fd,  NULL);
+                epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, c->efd, NULL);
+                c->events = 0;
+                c->dnext  = detached;
+                detached  = c;
+            }
+        }
+
+        while (detached) {
+            MessageQueueConnection *c = detached;
+            detached = detached->dnext;
+            mq_finished(c);
+        }
+    }
+
+    return NULL;
+}
+
+/* Consumer Functions */
+
+/**
+ * Deal retrieved messages to the workers' rings in chunks (round-robin,
+ * skipping full rings) and wake any idle workers.
+ * @param   consumer    Message Queue Consumer structure.
+ * @param   messages    Messages to deal.
+ * @param   n           Number of messages (at most CONSUME_BATCH).
+ **/
+static void mq_consumer_deal(MessageQueueConsumer *consumer, char **messages, size_t n) {
+    size_t chunk = (n + consumer->nworkers - 1) / consumer->nworkers;
+
+    // prefetching stops at limit, so the rings always have room for a batch
+    for (size_t m = 0; m < n; ) {
+        ConsumerWorker *w = &consumer->workers[consumer->next];
+        consumer->next = (consumer->next + 1) % consumer->nworkers;
+
+        mutex_lock(&w->lock);
+        size_t count = 0;
+        while (m < n && count < chunk && w->tail - w->head < CONSUME_LOCAL) {
+            w->messages[w->tail++ & (CONSUME_LOCAL - 1)] = messages[m++];
+            count++;
+        }
+        __atomic_add_fetch(&consumer->available, count, __ATOMIC_RELEASE);
+        mutex_unlock(&w->lock);
+    }
+
+    mutex_lock(&consumer->lock);
+    if (consumer->idle)
+        cond_broadcast(&consumer->ready);
+    mutex_unlock(&consumer->lock);
+}
+
+/**
+ * Steal the newer half of the first other worker's ring that is not empty
+ * into the worker's stash.
+ * @param   w           Consumer Worker structure (with an empty stash).
+ * @return  Whether or not any messages were stolen.
+ **/
+static bool mq_consumer_steal(ConsumerWorker *w) {
+    MessageQueueConsumer *consumer = w->consumer;
+
+    for (size_t i = 1; i < consumer->nworkers && !w->nstash; i++) {
+        ConsumerWorker *victim = &consumer->workers[(w->id + i) % consumer->nworkers];
+
+        mutex_lock(&victim->lock);
+        size_t half = (victim->tail - victim->head + 1) / 2;
+        while (w->nstash < half)
+            w->stash[w->nstash++] = victim->messages[--victim->tail & (CONSUME_LOCAL - 1)];
+        mutex_unlock(&victim->lock);
+    }
+
+    return w->nstash > 0;
+}
+
+/**
+ * Take next message for worker: from its stash, then its ring, then stolen
+ * from another worker, waiting while no messages are available anywhere.
+ * @param   w           Consumer Worker structure.
+ * @return  Message to handle (NULL once the dispatcher has finished and every
+ *          message has been taken).
+ **/
+static char *mq_consumer_take(ConsumerWorker *w) {
+    MessageQueueConsumer *consumer = w->consumer;
+
+    while (true) {
+        if (w->nstash)
+            return w->stash[--w->nstash];
+
+        char *message = NULL;
+        mutex_lock(&w->lock);
+        if (w->head != w->tail)
+            message = w->messages[w->head++ & (CONSUME_LOCAL - 1)];
+        mutex_unlock(&w->lock);
+
+        if (message || mq_consumer_steal(w)) {
+            size_t taken = message ? 1 : w->nstash;
+            size_t left  = __atomic_sub_fetch(&consumer->available, taken, __ATOMIC_ACQ_REL);
+
+            // wake the dispatcher as the rings fall below half its limit
+            if (left < consumer->limit / 2 && left + taken >= consumer->limit / 2) {
+                mutex_lock(&consumer->lock);
+                cond_signal(&consumer->drained);
+                mutex_unlock(&consumer->lock);
+            }
+
+            if (message)
+                return message;
+            continue;
+        }
+
+        // taken messages stay counted until their taker updates available
+        mutex_lock(&consumer->lock);
+        consumer->idle++;
+        while (!__atomic_load_n(&consumer->available, __ATOMIC_ACQUIRE) && !consumer->finished)
+            cond_wait(&consumer->ready, &consumer->lock);
+        consumer->idle--;
+        bool done = consumer->finished && !__atomic_load_n(&consumer->available, __ATOMIC_ACQUIRE);
+        mutex_unlock(&consumer->lock);
+
+        if (done)
+            return NULL;
+    }
+}
+
+/**
+ * Dispatcher thread retrieves batches of messages and deals them to the
+ * workers until the message queue is shutdown, waiting whenever the workers
+ * already have limit messages waiting.
+ **/
+void *mq_dispatcher(void *arg) {
+    MessageQueueConsumer *consumer = (MessageQueueConsumer *)arg;
+    char *messages[CONSUME_BATCH];
+
+    while (true) {
+        mutex_lock(&consumer->lock);
+        while (__atomic_load_n(&consumer->available, __ATOMIC_ACQUIRE) >= consumer->limit && !consumer->stopping)
+            cond_wait(&consumer->drained, &consumer->lock);
+        bool stopping = consumer->stopping;
+        mutex_unlock(&consumer->lock);
+
+        if (stopping)
+            break;
+
+        size_t n = mq_retrieve_many(consumer->mq, CONSUME_BATCH, messages);
+        if (n)
+            mq_consumer_deal(consumer, messages, n);
+        else if (mq_shutdown(consumer->mq))
+            break;
+    }
+
+    mutex_lock(&consumer->lock);
+    consumer->finished = true;
+    cond_broadcast(&consumer->ready);
+    mutex_unlock(&consumer->lock);
+    return NULL;
+}
+
+/**
+ * Worker thread calls the handler with each message it takes until the
+ * dispatcher has finished and every message has been handled.
+ **/
+void *mq_worker(void *arg) {
+    ConsumerWorker *      w = (ConsumerWorker *)arg;
+    MessageQueueConsumer *consumer = w->consumer;
+    char *message;
+
+    while ((message = mq_consumer_take(w))) {
+        consumer->handler(consumer->mq, message, consumer->arg);
+        free(message);
+    }
+
+    return NULL;
+}
+
+/**
+ * Stop the message queue's consumer (if any), waiting for the workers to
+ * handle every message already dealt and releasing the pool.
+ * @param   mq      Message Queue structure (with its connections stopped).
+ **/
+void mq_consumer_stop(MessageQueue *mq) {
+    MessageQueueConsumer *consumer = mq->consumer;
+    if (!consumer)
+        return;
+
+    mutex_lock(&consumer->lock);
+    consumer->stopping = true;
+    cond_broadcast(&consumer->drained);
+    mutex_unlock(&consumer->lock);
+
+    thread_join(consumer->dispatcher, NULL);
+    for (size_t w = 0; w < consumer->nworkers; w++) {
+        thread_join(consumer->workers[w].thread, NULL);
+        mutex_destroy(&consumer->workers[w].lock);
+    }
+
+    mutex_destroy(&consumer->lock);
+    cond_destroy(&consumer->ready);
+    cond_destroy(&consumer->drained);
+    free(consumer->workers);
+    free(consumer);
+    mq->consumer = NULL;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,165 @@
+/* histogram.c: Log-linear latency histogram */
+
+#include "mq/histogram.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Internal Functions */
+
+/**
+ * Compute bucket index of value: values below 2^SUBBITS have their own
+ * bucket, while each larger power of two is split into 2^SUBBITS buckets.
+ * @param   value       Value to locate.
+ * @return  Bucket index.
+ */
+static size_t histogram_index(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUBBITS))
+        return value;
+
+    unsigned shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUBBITS;
+    return ((size_t)(shift + 1) << HISTOGRAM_SUBBITS)
+         + ((value >> shift) & ((1 << HISTOGRAM_SUBBITS) - 1));
+}
+
+/**
+ * Compute largest value that falls in bucket.
+ * @param   index       Bucket index.
+ * @return  Upper bound of bucket.
+ */
+static uint64_t histogram_bound(size_t index) {
+    if (index < (1 << HISTOGRAM_SUBBITS))
+        return index;
+
+    unsigned shift = (index >> HISTOGRAM_SUBBITS) - 1;
+    uint64_t base  = (1 << HISTOGRAM_SUBBITS) | (index & ((1 << HISTOGRAM_SUBBITS) - 1));
+    return (base << shift) + ((1ULL << shift) - 1);
+}
+
+/* External Functions */
+
+/**
+ * Initialize empty histogram.
+ * @param   h           Histogram structure.
+ */
+void histogram_init(Histogram *h) {
+    memset(h, 0, sizeof(Histogram));
+    h->min = UINT64_MAX;
+}
+
+/**
+ * Record value in histogram (not thread-safe: record into a histogram per
+ * thread and merge them afterwards).  Fields are updated with single atomic
+ * stores, so other threads may read the histogram with histogram_snapshot
+ * while its one writer records.
+ * @param   h           Histogram structure.
+ * @param   value       Value to record.
+ */
+void histogram_record(Histogram *h, uint64_t value) {
+    size_t index = histogram_index(value);
+
+    __atomic_store_n(&h->counts[index], h->counts[index] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value < h->min)
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copy histogram that may be concurrently recorded into by another thread
+ * (the copy need not be consistent: count may differ from the sum of counts).
+ * @param   dst         Histogram structure to copy to.
+ * @param   src         Histogram structure to copy from.
+ */
+void histogram_snapshot(Histogram *dst, const Histogram *src) {
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+        dst->counts[b] = __atomic_load_n(&src->counts[b], __ATOMIC_RELAXED);
+
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum   = __atomic_load_n(&src->sum,   __ATOMIC_RELAXED);
+    dst->min   = __atomic_load_n(&src->min,   __ATOMIC_RELAXED);
+    dst->max   = __atomic_load_n(&src->max,   __ATOMIC_RELAXED);
+}
+
+/**
+ * Add all values recorded in one histogram to another.
+ * @param   dst         Histogram structure to add to.
+ * @param   src         Histogram structure to add from.
+ */
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+        dst->counts[b] += src->counts[b];
+
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/**
+ * Estimate value at percentile (within the precision of its bucket).
+ * @param   h           Histogram structure.
+ * @param   percentile  Percentile between 0 and 100.
+ * @return  Largest value of bucket containing percentile (0 if empty).
+ */
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    if (!h->count)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t bound = histogram_bound(b);
+            return bound < h->max ? (bound > h->min ? bound : h->min) : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/**
+ * Compute mean of recorded values.
+ * @param   h           Histogram structure.
+ * @return  Mean value (0 if empty).
+ */
+double histogram_mean(const Histogram *h) {
+    return h->count ? (double)h->sum / h->count : 0.0;
+}
+
+/**
+ * Write summary of histogram as JSON object:
+ *
+ *  {"count": N, "min": N, "mean": N, "p50": N, "p99": N, "p999": N, "max": N}
+ *
+ * @param   h           Histogram structure.
+ * @param   fs          File stream to write to.
+ */
+void histogram_write(const Histogram *h, FILE *fs) {
+    fprintf(fs, "{\"count\": %lu, \"min\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}",
+            h->count, h->count ? h->min : 0, histogram_mean(h),
+            histogram_percentile(h, 50.0), histogram_percentile(h, 99.0), histogram_percentile(h, 99.9),
+            h->max);
+}
+
+/**
+ * Read monotonic clock.
+ * @return  Current time in nanoseconds.
+ */
+uint64_t histogram_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
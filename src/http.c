@@ -0,0 +1,375 @@
+/* http.c: HTTP message parsing and formatting */
+
+#define _GNU_SOURCE
+
+#include "mq/http.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Internal Functions */
+
+/**
+ * Parse header block of HTTP message:
+ *
+ *  $FIRST $SECOND $THIRD\r\n
+ *  $NAME: $VALUE\r\n
+ *  ...
+ *  \r\n
+ *
+ * @param   p           HTTP parser structure.
+ * @param   data        Bytes received so far.
+ * @param   length      Number of bytes received so far.
+ * @param   line        Buffer (of HTTP_HEADER_MAX bytes) to store start line.
+ * @param   tokens      Start line tokens (pointers into line).
+ * @param   content     Value of Content-Length header.
+ * @param   flags       HTTP_KEEPALIVE, HTTP_VERSION_11, and HTTP_CHUNKED flags.
+ * @param   response    Whether the start line is a status line.
+ * @return  Length of header block, 0 if incomplete, -1 if malformed, or
+ *          HTTP_TOO_LARGE if longer than HTTP_HEADER_MAX.
+ */
+static ssize_t http_parse_header(HTTPParser *p, const char *data, size_t length,
+                                 char *line, char *tokens[3], size_t *content, int *flags,
+                                 bool response) {
+    size_t from = p->scanned > 3 ? p->scanned - 3 : 0;
+    const char *terminator = from < length ? memmem(data + from, length - from, "\r\n\r\n", 4) : NULL;
+
+    if (!terminator) {
+        p->scanned = length;
+        return length > HTTP_HEADER_MAX ? HTTP_TOO_LARGE : 0;
+    }
+
+    size_t header = terminator - data + 4;
+    if (header > HTTP_HEADER_MAX)
+        return HTTP_TOO_LARGE;
+    p->scanned = header - 1;
+
+    /* Start line */
+    const char *eol = memchr(data, '\r', header);
+    size_t n = eol - data;
+    memcpy(line, data, n);
+    line[n] = 0;
+
+    char *save = NULL;
+    tokens[0] = strtok_r(line, " ", &save);
+    tokens[1] = strtok_r(NULL, " ", &save);
+    tokens[2] = save && *save ? save : "";
+    if (!tokens[0] || !tokens[1])
+        return -1;
+
+    const char *version = response ? tokens[0] : tokens[2];
+    if (strncmp(version, "HTTP/1.", 7) != 0)
+        return -1;
+
+    /* Header fields: connections persist by default only with HTTP/1.1 */
+    bool v11       = version[7] == '1';
+    bool keepalive = v11;
+    bool chunked   = false;
+    *content = 0;
+
+    for (const char *h = eol + 2; h < terminator; h = eol + 2) {
+        eol = memchr(h, '\r', terminator + 2 - h);
+        const char *colon = memchr(h, ':', eol - h);
+        if (!colon)
+            continue;
+
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+
+        size_t name = colon - h;
+        if (name == 14 && strncasecmp(h, "Content-Length", 14) == 0) {
+            // only digits (strtoul would accept a sign and stop at garbage),
+            // few enough that they cannot overflow
+            const char *end = value;
+            while (end < eol && isdigit((unsigned char)*end))
+                end++;
+            if (end == value || end - value > 18)
+                return -1;
+            for (const char *rest = end; rest < eol; rest++)
+                if (*rest != ' ' && *rest != '\t')
+                    return -1;
+            *content = strtoul(value, NULL, 10);
+        } else if (name == 10 && strncasecmp(h, "Connection", 10) == 0) {
+            keepalive = strncasecmp(value, "keep-alive", 10) == 0;
+        } else if (name == 17 && strncasecmp(h, "Transfer-Encoding", 17) == 0) {
+            chunked = strncasecmp(value, "chunked", 7) == 0;
+        }
+    }
+
+    /* Only responses may be chunked (chunked requests are not supported) */
+    if (chunked && !response)
+        return -1;
+
+    *flags = (keepalive ? HTTP_KEEPALIVE : 0) | (v11 ? HTTP_VERSION_11 : 0) | (chunked ? HTTP_CHUNKED : 0);
+    return header;
+}
+
+/**
+ * Parse complete HTTP message into a Request structure.
+ * @param   p           HTTP parser structure.
+ * @param   data        Bytes received so far.
+ * @param   length      Number of bytes received so far.
+ * @param   message     Newly allocated message (if complete).
+ * @param   flags       HTTP_KEEPALIVE, HTTP_VERSION_11, and HTTP_CHUNKED flags.
+ * @param   response    Whether the start line is a status line.
+ * @return  Number of bytes consumed, 0 if incomplete, -1 if malformed, or
+ *          HTTP_TOO_LARGE if the header block or the body of a request is
+ *          over its limit.  The body of a chunked response is not consumed (the message has an
+ *          empty body and its chunks are parsed with http_chunk_next).
+ */
+static ssize_t http_parse(HTTPParser *p, const char *data, size_t length,
+                          Request **message, int *flags, bool response) {
+    char    line[HTTP_HEADER_MAX];
+    char *  tokens[3];
+    size_t  content;
+
+    ssize_t header = http_parse_header(p, data, length, line, tokens, &content, flags, response);
+    if (header <= 0)
+        return header;
+
+    if (*flags & HTTP_CHUNKED)
+        content = 0;
+
+    // responses are trusted (batches of messages may be larger)
+    if (!response && content > HTTP_BODY_MAX)
+        return HTTP_TOO_LARGE;
+
+    if (length - header < content)
+        return 0;
+
+    /* Responses always have a body (even if empty), requests only if sent */
+    const char *body = content || response ? data + header : NULL;
+    Request *r = response ? request_create_body(tokens[1], tokens[2], body, content)
+                          : request_create_body(tokens[0], tokens[1], body, content);
+    if (!r)
+        return -1;
+
+    *message = r;
+    http_parser_init(p);
+    return header + content;
+}
+
+/* External Functions */
+
+/**
+ * Initialize HTTP parser.
+ * @param   p           HTTP parser structure.
+ */
+void http_parser_init(HTTPParser *p) {
+    p->scanned = 0;
+}
+
+/**
+ * Parse HTTP request (method, uri, and body) from buffered data.
+ * @param   p           HTTP parser structure.
+ * @param   data        Bytes received so far.
+ * @param   length      Number of bytes received so far.
+ * @param   request     Newly allocated Request structure (if complete).
+ * @param   flags       HTTP_KEEPALIVE and HTTP_VERSION_11 flags.
+ * @return  Number of bytes consumed, 0 if incomplete, -1 if malformed, or
+ *          HTTP_TOO_LARGE if over HTTP_HEADER_MAX or HTTP_BODY_MAX.
+ */
+ssize_t http_parse_request(HTTPParser *p, const char *data, size_t length, Request **request, int *flags) {
+    return http_parse(p, data, length, request, flags, false);
+}
+
+/**
+ * Parse HTTP response from buffered data into a Request structure with the
+ * status code as the method, the reason as the uri, and the response body.
+ * @param   p           HTTP parser structure.
+ * @param   data        Bytes received so far.
+ * @param   length      Number of bytes received so far.
+ * @param   response    Newly allocated Request structure (if complete).
+ * @param   flags       HTTP_KEEPALIVE, HTTP_VERSION_11, and HTTP_CHUNKED flags.
+ * @return  Number of bytes consumed, 0 if incomplete, -1 if malformed, or
+ *          HTTP_TOO_LARGE if the header block is over HTTP_HEADER_MAX.
+ */
+ssize_t http_parse_response(HTTPParser *p, const char *data, size_t length, Request **response, int *flags) {
+    return http_parse(p, data, length, response, flags, true);
+}
+
+/**
+ * Return reason phrase for HTTP status code.
+ * @param   status      HTTP status code.
+ * @return  Reason phrase string.
+ */
+const char *http_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 413: return "Payload Too Large";
+        case 503: return "Service Unavailable";
+        default:  return "Internal Server Error";
+    }
+}
+
+/**
+ * Append HTTP response to buffer:
+ *
+ *  HTTP/1.x $STATUS $REASON\r\n
+ *  Content-Length: Length($BODY)\r\n
+ *  Connection: keep-alive|close\r\n
+ *  \r\n
+ *  $BODY
+ *
+ * @param   b           Buffer structure.
+ * @param   status      HTTP status code.
+ * @param   body        Response body.
+ * @param   length      Length of response body.
+ * @param   flags       HTTP_KEEPALIVE and HTTP_VERSION_11 flags of request.
+ * @return  Whether or not the response was appended.
+ */
+bool http_write_response(Buffer *b, int status, const char *body, size_t length, int flags) {
+    bool v11       = flags & HTTP_VERSION_11;
+    bool keepalive = flags & HTTP_KEEPALIVE;
+
+    return buffer_printf(b, "HTTP/1.%d %d %s\r\nContent-Length: %lu\r\n%s\r\n",
+                         v11, status, http_reason(status), length,
+                         keepalive ? (v11 ? "" : "Connection: keep-alive\r\n")
+                                   : (v11 ? "Connection: close\r\n" : ""))
+        && buffer_append(b, body, length);
+}
+
+/**
+ * Append header of streaming response to buffer:
+ *
+ *  HTTP/1.1 200 OK\r\n
+ *  Transfer-Encoding: chunked\r\n
+ *  \r\n
+ *
+ * The body that follows is an unbounded sequence of chunks, each holding one
+ * or more complete length-prefixed frames, so streams are always answered as
+ * HTTP/1.1 (the client parses them regardless of the version it requested).
+ * @param   b           Buffer structure.
+ * @return  Whether or not the header was appended.
+ */
+bool http_write_stream(Buffer *b) {
+    static const char HEADER[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    return buffer_append(b, HEADER, sizeof(HEADER) - 1);
+}
+
+/**
+ * Append start of chunk to buffer (the caller then appends exactly length
+ * bytes of data followed by http_chunk_end):
+ *
+ *  Hex(Length($DATA))\r\n
+ *  $DATA\r\n
+ *
+ * A chunk of length 0 (followed by http_chunk_end) ends the body.
+ * @param   b           Buffer structure.
+ * @param   length      Length of chunk data.
+ * @return  Whether or not the chunk size line was appended.
+ */
+bool http_chunk_begin(Buffer *b, size_t length) {
+    return buffer_printf(b, "%lx\r\n", length);
+}
+
+/**
+ * Append end of chunk to buffer.
+ * @param   b           Buffer structure.
+ * @return  Whether or not the chunk terminator was appended.
+ */
+bool http_chunk_end(Buffer *b) {
+    return buffer_append(b, "\r\n", 2);
+}
+
+/**
+ * Locate the next chunk of a chunked body (chunk extensions are ignored and
+ * trailers are not supported).
+ * @param   data        Bytes received so far.
+ * @param   length      Number of bytes received so far.
+ * @param   chunk       Set to start of chunk data.
+ * @param   clength     Set to length of chunk data (0 for the last chunk).
+ * @return  Number of bytes consumed by chunk, 0 if incomplete, -1 if malformed.
+ */
+ssize_t http_chunk_next(const char *data, size_t length, const char **chunk, size_t *clength) {
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i < length && isxdigit((unsigned char)data[i]); i++) {
+        if (n > (SIZE_MAX >> 4))
+            return -1;
+        n = (n << 4) | (isdigit((unsigned char)data[i]) ? data[i] - '0' : (tolower((unsigned char)data[i]) - 'a' + 10));
+    }
+
+    if (i == length)
+        return length > HTTP_HEADER_MAX ? -1 : 0;
+    if (i == 0 || (data[i] != '\r' && data[i] != ';'))
+        return -1;
+
+    const char *eol = memmem(data + i, length - i, "\r\n", 2);
+    if (!eol)
+        return length > HTTP_HEADER_MAX ? -1 : 0;
+
+    size_t start = eol - data + 2;
+    if (length - start < 2 || n > length - start - 2)
+        return 0;
+    if (data[start + n] != '\r' || data[start + n + 1] != '\n')
+        return -1;
+
+    *chunk   = data + start;
+    *clength = n;
+    return start + n + 2;
+}
+
+/**
+ * Compute size of length-prefixed frame.
+ * @param   length      Length of frame data.
+ * @return  Number of bytes http_frame_append appends for frame.
+ */
+size_t http_frame_length(size_t length) {
+    size_t digits = 1;
+    for (size_t n = length; n >= 10; n /= 10)
+        digits++;
+    return digits + 1 + length;
+}
+
+/**
+ * Append one length-prefixed frame of a message batch to buffer:
+ *
+ *  Length($DATA)\n
+ *  $DATA
+ *
+ * @param   b           Buffer structure.
+ * @param   data        Frame data.
+ * @param   length      Length of frame data.
+ * @return  Whether or not the frame was appended.
+ */
+bool http_frame_append(Buffer *b, const char *data, size_t length) {
+    return buffer_printf(b, "%lu\n", length) && buffer_append(b, data, length);
+}
+
+/**
+ * Locate the next length-prefixed frame of a message batch.
+ * @param   data        Batch data.
+ * @param   length      Length of batch data.
+ * @param   frame       Set to start of frame data.
+ * @param   flength     Set to length of frame data.
+ * @return  Number of bytes consumed by frame (-1 if malformed or truncated).
+ */
+ssize_t http_frame_next(const char *data, size_t length, const char **frame, size_t *flength) {
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i < length && data[i] != '\n'; i++) {
+        if (data[i] < '0' || data[i] > '9' || n > (SIZE_MAX - 9) / 10)
+            return -1;
+        n = n * 10 + (data[i] - '0');
+    }
+
+    if (i == 0 || i == length || n > length - i - 1)
+        return -1;
+
+    *frame   = data + i + 1;
+    *flength = n;
+    return i + 1 + n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,279 @@
+/* logging.c: Asynchronous logging backend */
+
+#include "mq/buffer.h"
+#include "mq/logging.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define LOG_RECORD      256         // Bytes per record (messages are truncated to fit)
+#define LOG_RING        128         // Records buffered per thread (power of 2)
+#define LOG_INTERVAL    10          // Milliseconds between drains
+
+#define CACHELINE       64
+
+/* Internal Structures */
+
+/* Each logging thread formats its records into its own single-producer ring,
+ * so writing a record never takes a lock or touches stdio.  A background
+ * thread periodically drains every ring (merging records by timestamp) and
+ * writes them with a single write call.  Records that do not fit in a full
+ * ring are dropped and counted rather than blocking the caller.  Rings are
+ * never freed: the ring of an exited thread is reused by the next thread
+ * that logs. */
+
+typedef struct LogRecord LogRecord;
+struct LogRecord {
+    uint64_t        timestamp;      // Monotonic time record was written (nanoseconds)
+    unsigned long   thread;
+    int             level;
+    char            text[LOG_RECORD - 2 * sizeof(uint64_t) - sizeof(int)];
+};
+
+typedef struct LogRing LogRing;
+struct LogRing {
+    LogRecord   records[LOG_RING];
+    LogRing *   next;               // Next ring in list of all rings
+    bool        active;             // Owned by a running thread (protected by RingsLock)
+
+    size_t      head        __attribute__((aligned(CACHELINE)));   // Written by producer
+    size_t      dropped;                                            // Written by producer
+    size_t      tail        __attribute__((aligned(CACHELINE)));   // Written by consumer
+    size_t      reported;                                           // Written by consumer
+};
+
+/* Internal Globals */
+
+static LogRing *            Rings      = NULL;
+static pthread_mutex_t      RingsLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t      DrainLock  = PTHREAD_MUTEX_INITIALIZER;     // Serializes consumers
+static pthread_cond_t       DrainCond  = PTHREAD_COND_INITIALIZER;
+static bool                 Stopping   = false;                         // Protected by DrainLock
+static pthread_t            Drainer;
+static pthread_key_t        LocalKey;
+static pthread_once_t       LocalOnce  = PTHREAD_ONCE_INIT;
+static __thread LogRing *   Local      = NULL;
+
+static const char *         LEVELS[]   = { "DEBUG", "INFO ", "ERROR" };
+
+/* Internal Functions */
+
+/**
+ * Read monotonic clock.
+ * @return  Current time in nanoseconds.
+ */
+static uint64_t log_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Write every record buffered in the rings to standard error (in timestamp
+ * order) along with a count of any records that were dropped.
+ */
+static void log_drain() {
+    Buffer out;
+    buffer_init(&out);
+
+    pthread_mutex_lock(&DrainLock);
+
+    /* Rings are only ever prepended, so the list can be walked without locking */
+    LogRing *rings = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE);
+    for (LogRing *ring = rings; ring; ring = ring->next) {
+        size_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            buffer_printf(&out, "[%09lu] ERROR Dropped %lu log messages\n",
+                          pthread_self(), dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+
+    while (true) {
+        LogRing *  oldest = NULL;
+        LogRecord *record = NULL;
+
+        for (LogRing *ring = rings; ring; ring = ring->next) {
+            if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                continue;
+
+            LogRecord *r = &ring->records[ring->tail & (LOG_RING - 1)];
+            if (!record || r->timestamp < record->timestamp) {
+                oldest = ring;
+                record = r;
+            }
+        }
+
+        if (!record)
+            break;
+
+        buffer_printf(&out, "[%09lu] %s %s\n", record->thread, LEVELS[record->level], record->text);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    while (buffer_length(&out)) {
+        ssize_t n = write(STDERR_FILENO, buffer_head(&out), buffer_length(&out));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        buffer_consume(&out, n);
+    }
+
+    pthread_mutex_unlock(&DrainLock);
+    buffer_free(&out);
+}
+
+/**
+ * Drainer thread writes buffered records every LOG_INTERVAL milliseconds
+ * until the process exits.
+ */
+static void *log_drainer(void *arg) {
+    pthread_mutex_lock(&DrainLock);
+    while (!Stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&DrainCond, &DrainLock, &deadline);
+        pthread_mutex_unlock(&DrainLock);
+        log_drain();
+        pthread_mutex_lock(&DrainLock);
+    }
+    pthread_mutex_unlock(&DrainLock);
+
+    return NULL;
+}
+
+/**
+ * Stop drainer thread and write any remaining records (at exit).
+ */
+static void log_stop() {
+    pthread_mutex_lock(&DrainLock);
+    Stopping = true;
+    pthread_cond_signal(&DrainCond);
+    pthread_mutex_unlock(&DrainLock);
+
+    pthread_join(Drainer, NULL);
+    log_drain();
+}
+
+/**
+ * Release thread's ring for reuse when it exits.
+ */
+static void log_destructor(void *arg) {
+    LogRing *ring = (LogRing *)arg;
+
+    pthread_mutex_lock(&RingsLock);
+    ring->active = false;
+    pthread_mutex_unlock(&RingsLock);
+}
+
+/**
+ * Start drainer thread (with all signals blocked, so that they are still
+ * delivered to the application's threads).
+ */
+static void log_init() {
+    sigset_t all, old;
+
+    pthread_key_create(&LocalKey, log_destructor);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&Drainer, NULL, log_drainer, NULL) == 0)
+        atexit(log_stop);
+    else
+        atexit(log_drain);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Get thread's ring (reusing the ring of an exited thread or allocating a new
+ * one on the thread's first record).
+ * @return  Thread's LogRing structure (or NULL on allocation failure).
+ */
+static LogRing *log_ring() {
+    if (Local)
+        return Local;
+
+    pthread_once(&LocalOnce, log_init);
+
+    pthread_mutex_lock(&RingsLock);
+    LogRing *ring = Rings;
+    while (ring && ring->active)
+        ring = ring->next;
+
+    if (!ring && posix_memalign((void **)&ring, CACHELINE, sizeof(LogRing)) == 0) {
+        memset(ring, 0, sizeof(LogRing));
+        ring->next = Rings;
+        __atomic_store_n(&Rings, ring, __ATOMIC_RELEASE);
+    }
+
+    if (ring)
+        ring->active = true;
+    pthread_mutex_unlock(&RingsLock);
+
+    if (ring) {
+        pthread_setspecific(LocalKey, ring);
+        Local = ring;
+    }
+    return ring;
+}
+
+/* External Functions */
+
+/**
+ * Format log record into calling thread's ring (or drop it if the ring is
+ * full) to be written to standard error by the drainer thread.
+ * @param   level       Log level (LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, or LOG_LEVEL_ERROR).
+ * @param   format      Format string for message.
+ */
+void log_write(int level, const char *format, ...) {
+    va_list  args;
+    LogRing *ring = log_ring();
+
+    if (!ring) {
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        fputc('\n', stderr);
+        return;
+    }
+
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head & (LOG_RING - 1)];
+    record->timestamp = log_timestamp();
+    record->thread    = pthread_self();
+    record->level     = level;
+
+    va_start(args, format);
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write all buffered log records to standard error now.
+ */
+void log_flush() {
+    log_drain();
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,6 +2,310 @@
 
 #include "mq/queue.h"
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define CACHELINE   64
+#define SPINS       64      // Attempts before parking on an empty/full ring
+
+/* Internal Structures */
+
+/* Bounded multi-producer/multi-consumer ring of sequence-numbered slots: a
+ * slot whose sequence equals the enqueue position is free to be filled and a
+ * slot whose sequence equals the dequeue position + 1 is ready to be taken. */
+
+typedef struct QueueSlot QueueSlot;
+struct QueueSlot {
+    size_t      sequence;
+    Request *   request;
+};
+
+struct QueueRing {
+    QueueSlot * slots;
+    size_t      mask;
+
+    size_t      enqueue     __attribute__((aligned(CACHELINE)));
+    size_t      dequeue     __attribute__((aligned(CACHELINE)));
+    size_t      consumers   __attribute__((aligned(CACHELINE)));   // Parked on notempty
+    size_t      producers;                                          // Parked on notfull
+};
+
+/* Internal Functions */
+
+/**
+ * Try to push request to the back of the ring (without blocking).
+ * @param   ring    Ring structure.
+ * @param   r       Request structure.
+ * @param   filled  Set to the position of the slot filled.
+ * @return  Whether or not the request was pushed (false if full).
+ */
+static bool queue_ring_push(QueueRing *ring, Request *r, size_t *filled) {
+    size_t position = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+    QueueSlot *slot;
+
+    while (true) {
+        slot = &ring->slots[position & ring->mask];
+        size_t   sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff     = (intptr_t)sequence - (intptr_t)position;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->request = r;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    *filled = position;
+    return true;
+}
+
+/**
+ * Try to pop request from the front of the ring (without blocking).
+ * @param   ring    Ring structure.
+ * @return  Request structure (or NULL if empty).
+ */
+static Request *queue_ring_pop(QueueRing *ring) {
+    size_t position = __atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED);
+    QueueSlot *slot;
+
+    while (true) {
+        slot = &ring->slots[position & ring->mask];
+        size_t   sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff     = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            position = __atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED);
+        }
+    }
+
+    Request *r = slot->request;
+    __atomic_store_n(&slot->sequence, position + ring->mask + 1, __ATOMIC_RELEASE);
+    return r;
+}
+
+/**
+ * Wake one thread parked on condition if any are registered as waiting.
+ * @param   q       Queue structure.
+ * @param   waiting Count of parked threads.
+ * @param   cond    Condition variable they are parked on.
+ */
+static void queue_ring_wake(Queue *q, size_t *waiting, Cond *cond) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        mutex_lock(&q->lock);
+        cond_signal(cond);
+        mutex_unlock(&q->lock);
+    }
+}
+
+/**
+ * Wait on condition until woken or until deadline passes.
+ * @param   cond    Condition variable to wait on.
+ * @param   lock    Mutex held by caller.
+ * @param   deadline    Absolute CLOCK_MONOTONIC time (NULL to wait forever).
+ * @return  Whether or not the deadline has passed.
+ */
+static bool queue_wait(Cond *cond, Mutex *lock, const struct timespec *deadline) {
+    if (!deadline) {
+        cond_wait(cond, lock);
+        return false;
+    }
+
+    int rc = pthread_cond_timedwait(cond, lock, deadline);
+    if (rc == ETIMEDOUT)
+        return true;
+    PTHREAD_CHECK(rc);
+    return false;
+}
+
+/**
+ * Pop request from the front of the ring, parking once spinning fails.
+ * @param   q       Queue structure.
+ * @param   deadline    Absolute CLOCK_MONOTONIC time (NULL to wait forever).
+ * @return  Request structure (or NULL if deadline passed).
+ */
+static Request *queue_ring_pop_wait(Queue *q, const struct timespec *deadline) {
+    QueueRing *ring = q->ring;
+    Request   *r;
+
+    for (size_t spin = 0; !(r = queue_ring_pop(ring)); spin++) {
+        if (spin < SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        mutex_lock(&q->lock);
+        __atomic_fetch_add(&ring->consumers, 1, __ATOMIC_SEQ_CST);
+        while (!(r = queue_ring_pop(ring))) {
+            if (queue_wait(&q->notempty, &q->lock, deadline)) {
+                r = queue_ring_pop(ring);
+                break;
+            }
+        }
+        __atomic_fetch_sub(&ring->consumers, 1, __ATOMIC_RELAXED);
+        mutex_unlock(&q->lock);
+        break;
+    }
+
+    if (r) {
+        __atomic_fetch_sub(&q->size, 1, __ATOMIC_RELAXED);
+        queue_ring_wake(q, &ring->producers, &q->notfull);
+    }
+    return r;
+}
+
+/**
+ * Signal queue's eventfd (if any) that the queue has become non-empty.
+ * @param   q       Queue structure.
+ */
+static void queue_notify(Queue *q) {
+    uint64_t one = 1;
+    if (q->notify >= 0 && write(q->notify, &one, sizeof(one)) < 0)
+        error("Unable to notify queue: %s", strerror(errno));
+}
+
+/**
+ * Determine whether queue has limits on what queue_push admits.
+ * @param   q       Queue structure.
+ */
+static inline bool queue_bounded(Queue *q) {
+    return q->max_size || q->max_bytes;
+}
+
+/**
+ * Determine whether request of length would exceed the limits of the queue
+ * (a lone request larger than the byte limit is still admitted to an empty
+ * queue, so that a blocked pusher always makes progress).
+ * @param   q       Queue structure (locked).
+ * @param   length  Length of request body.
+ */
+static bool queue_full(Queue *q, size_t length) {
+    return (q->max_size  && q->size >= q->max_size) ||
+           (q->max_bytes && q->bytes && q->bytes + length > q->max_bytes);
+}
+
+/**
+ * Delete the oldest request with a body from linked list queue.
+ * @param   q       Queue structure (locked).
+ * @return  Whether or not a request was deleted.
+ */
+static bool queue_evict(Queue *q) {
+    Request *prev = NULL, *r = q->head;
+
+    while (r && !r->body) {
+        prev = r;
+        r    = r->next;
+    }
+    if (!r)
+        return false;
+
+    if (prev)
+        prev->next = r->next;
+    else
+        q->head = r->next;
+    if (q->tail == r)
+        q->tail = prev;
+
+    q->size--;
+    q->bytes -= request_length(r);
+    q->dropped++;
+    request_delete(r);
+    return true;
+}
+
+/**
+ * Wait for room for request in linked list queue according to its policy.
+ * Requests without a body (e.g. retrievals, subscriptions, and shutdown
+ * sentinels) are always admitted and never evicted.
+ * @param   q       Queue structure (locked).
+ * @param   r       Request structure.
+ * @return  Whether or not the request may be appended.
+ */
+static bool queue_admit(Queue *q, Request *r) {
+    if (!queue_bounded(q) || !r->body)
+        return true;
+
+    size_t length = request_length(r);
+    while (queue_full(q, length)) {
+        switch (q->policy) {
+            case QUEUE_BLOCK:
+                cond_wait(&q->notfull, &q->lock);
+                break;
+            case QUEUE_FAIL:
+                q->rejected++;
+                return false;
+            case QUEUE_DROP_OLDEST:
+                if (!queue_evict(q))
+                    return true;
+                break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Append list of requests to linked list queue.
+ * @param   q       Queue structure (locked).
+ * @param   head    First Request structure in list.
+ * @param   tail    Last Request structure in list.
+ * @param   n       Number of requests in list.
+ * @param   bytes   Total length of request bodies in list.
+ */
+static void queue_append(Queue *q, Request *head, Request *tail, size_t n, size_t bytes) {
+    if (q->tail)
+        q->tail->next = head;
+    q->tail = tail;
+    if (!q->head)
+        q->head = head;
+    q->size  += n;
+    q->bytes += bytes;
+
+    if (q->size > q->peak_size)
+        q->peak_size = q->size;
+    if (q->bytes > q->peak_bytes)
+        q->peak_bytes = q->bytes;
+}
+
+/**
+ * Remove request from the front of linked list queue.
+ * @param   q       Queue structure (locked).
+ * @return  Request structure (or NULL if queue is empty).
+ */
+static Request *queue_take(Queue *q) {
+    Request *r = q->head;
+
+    if (r) {
+        q->head = r->next;
+        if (q->tail == r)
+            q->tail = NULL;
+        --q->size;
+        q->bytes -= request_length(r);
+    }
+
+    return r;
+}
+
+/* External Functions */
+
 /**
  * Create queue structure.
  * @return  Newly allocated queue structure.
@@ -12,58 +316,216 @@ Queue * queue_create() {
     {
         ptr->head = ptr->tail = NULL;
         ptr->size = 0;
-        // init the mutex lock and condition variable
+        ptr->ring = NULL;
+        ptr->notify = -1;
+        ptr->bytes = ptr->max_size = ptr->max_bytes = 0;
+        ptr->policy = QUEUE_BLOCK;
+        ptr->peak_size = ptr->peak_bytes = 0;
+        ptr->dropped = ptr->rejected = 0;
+        // init the mutex lock and condition variable (timed waits use the monotonic clock)
+        pthread_condattr_t attr;
+        PTHREAD_CHECK(pthread_condattr_init(&attr));
+        PTHREAD_CHECK(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
         mutex_init(&ptr->lock, NULL);
-        cond_init(&ptr->notempty, NULL);
+        cond_init(&ptr->notempty, &attr);
+        cond_init(&ptr->notfull, &attr);
+        PTHREAD_CHECK(pthread_condattr_destroy(&attr));
     }
 
     return ptr;
 }
 
+/**
+ * Create queue structure backed by a lock-free ring buffer.  Pushes and pops
+ * only take the queue lock to park when the ring is empty (or full).
+ * @param   capacity    Maximum number of requests (rounded up to a power of 2).
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_ring(size_t capacity) {
+    Queue * ptr = queue_create();
+    if (!ptr)
+        return NULL;
+
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    QueueRing *ring = NULL;
+    if (posix_memalign((void **)&ring, CACHELINE, sizeof(QueueRing)) != 0 ||
+        !(ring->slots = malloc(size * sizeof(QueueSlot)))) {
+        free(ring);
+        queue_delete(ptr);
+        return NULL;
+    }
+
+    for (size_t s = 0; s < size; s++)
+        ring->slots[s].sequence = s;
+    ring->mask      = size - 1;
+    ring->enqueue   = 0;
+    ring->dequeue   = 0;
+    ring->consumers = 0;
+    ring->producers = 0;
+
+    ptr->ring = ring;
+    return ptr;
+}
+
+/**
+ * Create linked list queue structure that limits what queue_push admits.
+ * @param   max_size    Maximum number of requests (0 for unlimited).
+ * @param   max_bytes   Maximum total length of request bodies (0 for unlimited).
+ * @param   policy      What queue_push does when a limit would be exceeded.
+ * @return  Newly allocated queue structure.
+ */
+Queue * queue_create_bounded(size_t max_size, size_t max_bytes, QueuePolicy policy) {
+    Queue * ptr = queue_create();
+    if (ptr) {
+        ptr->max_size  = max_size;
+        ptr->max_bytes = max_bytes;
+        ptr->policy    = policy;
+    }
+    return ptr;
+}
+
 /**
  * Delete queue structure.
  * @param   q       Queue structure.
  */
 void queue_delete(Queue *q) {
-    printf("Current function: %s\n", __FUNCTION__);
-
     if (q)
     {
         Request * cur = q->head, * next;
         while (cur)
         {
-            printf("delete: %p\n", cur);
             next = cur->next;
             request_delete(cur);
             cur = next;
         }
 
+        if (q->ring)
+        {
+            while ((cur = queue_ring_pop(q->ring)))
+                request_delete(cur);
+            free(q->ring->slots);
+            free(q->ring);
+        }
+
         // destroy the mutex lock and condition variable
         mutex_destroy(&q->lock);
         cond_destroy(&q->notempty);
+        cond_destroy(&q->notfull);
     }
 
     free(q);
 }
 
 /**
- * Push request to the back of queue.
+ * Push request to the back of queue (block while a ring queue is full).  A
+ * bounded queue applies its policy if the request would exceed its limits.
  * @param   q       Queue structure.
  * @param   r       Request structure.
+ * @return  Whether or not the request was pushed (false only if rejected by
+ *          QUEUE_FAIL, in which case the caller still owns the request).
  */
-void queue_push(Queue *q, Request *r) {
+bool queue_push(Queue *q, Request *r) {
+    if (q->ring) {
+        QueueRing *ring = q->ring;
+        r->next = NULL;
+
+        // count before publishing so size never underflows in queue_pop
+        __atomic_fetch_add(&q->size, 1, __ATOMIC_RELAXED);
+
+        size_t position;
+        for (size_t spin = 0; !queue_ring_push(ring, r, &position); spin++) {
+            if (spin < SPINS) {
+                sched_yield();
+                continue;
+            }
+
+            mutex_lock(&q->lock);
+            __atomic_fetch_add(&ring->producers, 1, __ATOMIC_SEQ_CST);
+            while (!queue_ring_push(ring, r, &position))
+                cond_wait(&q->notfull, &q->lock);
+            __atomic_fetch_sub(&ring->producers, 1, __ATOMIC_RELAXED);
+            mutex_unlock(&q->lock);
+            break;
+        }
+
+        // size includes pushers still waiting for room, so whether the
+        // consumer may be idle is judged by the ring itself: it has caught up
+        // with this request unless an earlier one is still waiting (whose
+        // pusher then notifies instead); queue_ring_wake fences the load
+        queue_ring_wake(q, &ring->consumers, &q->notempty);
+        if (__atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED) >= position)
+            queue_notify(q);
+        return true;
+    }
+
+    r->next = NULL;  // request may still link to the queue it was popped from
+
     mutex_lock(&q->lock);  // lock
-    
-    if (q->tail)
-        q->tail->next = r;
-    q->tail = r;
-    if (!q->head)
-        q->head = r;
-    ++q->size;
 
-    cond_signal(&q->notempty);  // send 'notempty' signal 
+    if (!queue_admit(q, r)) {
+        mutex_unlock(&q->lock);
+        return false;
+    }
+
+    bool empty = q->size == 0;
+    queue_append(q, r, r, 1, request_length(r));
+
+    cond_signal(&q->notempty);  // send 'notempty' signal
 
     mutex_unlock(&q->lock);  // unlock
+
+    if (empty)
+        queue_notify(q);
+    return true;
+}
+
+/**
+ * Push list of requests (linked by next) to the back of queue in order, taking
+ * the queue lock once for the whole list (ignoring any limits).
+ *
+ * A ring cannot hold more than its capacity, so each request is pushed in
+ * turn, blocking while the ring is full.  Threads that must never block (the
+ * client's I/O threads) only push lists onto linked-list queues.
+ * @param   q       Queue structure.
+ * @param   head    First Request structure in list.
+ */
+void queue_push_all(Queue *q, Request *head) {
+    if (!head)
+        return;
+
+    if (q->ring) {
+        for (Request *r = head, *next; r; r = next) {
+            next = r->next;
+            queue_push(q, r);
+        }
+        return;
+    }
+
+    Request *tail  = head;
+    size_t   n     = 1;
+    size_t   bytes = request_length(head);
+    for (; tail->next; tail = tail->next) {
+        bytes += request_length(tail->next);
+        n++;
+    }
+
+    mutex_lock(&q->lock);
+
+    bool empty = q->size == 0;
+    queue_append(q, head, tail, n, bytes);
+
+    if (n > 1)
+        cond_broadcast(&q->notempty);
+    else
+        cond_signal(&q->notempty);
+
+    mutex_unlock(&q->lock);
+
+    if (empty)
+        queue_notify(q);
 }
 
 /**
@@ -74,6 +536,9 @@ void queue_push(Queue *q, Request *r) {
 Request * queue_pop(Queue *q) {
     Request * r;
 
+    if (q->ring)
+        return queue_ring_pop_wait(q, NULL);
+
     mutex_lock(&q->lock);  // lock
 
     while (q->size == 0)
@@ -82,16 +547,169 @@ Request * queue_pop(Queue *q) {
     }
     // dequeue
     assert(q->head);
-    r = q->head;
-    q->head = q->head->next;
+    r = queue_take(q);
 
-    if (q->tail == r)
-        q->tail = NULL;
-    --q->size;
+    if (queue_bounded(q))
+        cond_signal(&q->notfull);
 
     mutex_unlock(&q->lock);  // unlock
 
     return r;
 }
 
+/**
+ * Pop up to max requests from the front of queue, taking the queue lock once
+ * (block until there is at least one to return).
+ * @param   q           Queue structure.
+ * @param   requests    Array of at least max entries set to the requests (in order).
+ * @param   max         Maximum number of requests to pop.
+ * @return  Number of requests popped.
+ */
+size_t queue_pop_batch(Queue *q, Request **requests, size_t max) {
+    size_t n = 0;
+
+    if (!max)
+        return 0;
+
+    if (q->ring) {
+        requests[n++] = queue_ring_pop_wait(q, NULL);
+        while (n < max && (requests[n] = queue_try_pop(q)))
+            n++;
+        return n;
+    }
+
+    mutex_lock(&q->lock);
+
+    while (q->size == 0)
+        cond_wait(&q->notempty, &q->lock);
+
+    for (; n < max && q->head; n++)
+        requests[n] = queue_take(q);
+
+    if (queue_bounded(q))
+        cond_broadcast(&q->notfull);
+
+    mutex_unlock(&q->lock);
+    return n;
+}
+
+/**
+ * Pop every request in queue at once (block until there is at least one to
+ * return).  A linked list queue is detached under a single lock acquisition.
+ * @param   q       Queue structure.
+ * @return  First Request structure in list (linked by next).
+ */
+Request * queue_pop_all(Queue *q) {
+    Request * head;
+
+    if (q->ring) {
+        Request *tail = head = queue_ring_pop_wait(q, NULL);
+        while ((tail->next = queue_try_pop(q)))
+            tail = tail->next;
+        return head;
+    }
+
+    mutex_lock(&q->lock);
+
+    while (q->size == 0)
+        cond_wait(&q->notempty, &q->lock);
+
+    head     = q->head;
+    q->head  = q->tail = NULL;
+    q->size  = 0;
+    q->bytes = 0;
+
+    if (queue_bounded(q))
+        cond_broadcast(&q->notfull);
+
+    mutex_unlock(&q->lock);
+    return head;
+}
+
+/**
+ * Pop request from the front of queue, blocking no later than deadline.
+ * @param   q           Queue structure.
+ * @param   deadline    Absolute CLOCK_MONOTONIC time to give up at.
+ * @return  Request structure (or NULL if deadline passed with queue empty).
+ */
+Request * queue_pop_timed(Queue *q, const struct timespec *deadline) {
+    Request * r = NULL;
+
+    if (q->ring)
+        return queue_ring_pop_wait(q, deadline);
+
+    mutex_lock(&q->lock);
+
+    while (q->size == 0) {
+        if (queue_wait(&q->notempty, &q->lock, deadline))
+            break;
+    }
+
+    if ((r = queue_take(q)) && queue_bounded(q))
+        cond_signal(&q->notfull);
+
+    mutex_unlock(&q->lock);
+    return r;
+}
+
+/**
+ * Pop request from the front of queue without blocking.
+ * @param   q       Queue structure.
+ * @return  Request structure (or NULL if queue is empty).
+ */
+Request * queue_try_pop(Queue *q) {
+    Request * r;
+
+    if (q->ring) {
+        // fence before giving up, so a pusher that finds this consumer caught
+        // up with its request (see queue_push) has either been seen or notifies
+        if (!(r = queue_ring_pop(q->ring))) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!(r = queue_ring_pop(q->ring)))
+                return NULL;
+        }
+
+        __atomic_fetch_sub(&q->size, 1, __ATOMIC_RELAXED);
+        queue_ring_wake(q, &q->ring->producers, &q->notfull);
+        return r;
+    }
+
+    mutex_lock(&q->lock);
+
+    if ((r = queue_take(q)) && queue_bounded(q))
+        cond_signal(&q->notfull);
+
+    mutex_unlock(&q->lock);
+    return r;
+}
+
+/**
+ * Pop every request in queue at once without blocking.
+ * @param   q       Queue structure.
+ * @return  First Request structure in list (linked by next, or NULL if empty).
+ */
+Request * queue_try_pop_all(Queue *q) {
+    Request * head;
+
+    if (q->ring) {
+        Request *tail = head = queue_try_pop(q);
+        while (tail && (tail->next = queue_try_pop(q)))
+            tail = tail->next;
+        return head;
+    }
+
+    mutex_lock(&q->lock);
+
+    head     = q->head;
+    q->head  = q->tail = NULL;
+    q->size  = 0;
+    q->bytes = 0;
+
+    if (head && queue_bounded(q))
+        cond_broadcast(&q->notfull);
+
+    mutex_unlock(&q->lock);
+    return head;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,9 +1,190 @@
 /* request.c: Request structure */
 
 #include "mq/request.h"
+#include "mq/thread.h"
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Internal Constants */
+
+#define POOL_CLASSES    6           // Size classes: 128, 256, ..., 4096 bytes
+#define POOL_MINIMUM    128         // Size of smallest class (bytes)
+#define POOL_LOCAL      64          // Requests cached per thread (per class)
+#define POOL_BATCH      32          // Requests moved between thread and depot
+#define POOL_DEPOT      1024        // Requests kept in shared depot (per class)
+
+#define SEND_VECTORS    1024        // I/O vectors per sendmsg call
+
+/* Internal Structures */
+
+/* Requests are allocated as a single block (the structure followed by its
+ * method, uri, and body strings) rounded up to a size class.  Freed blocks
+ * are cached in per-thread free lists, with batches exchanged through a
+ * shared depot so that requests deleted by one thread (e.g. after queue_pop)
+ * are recycled by request_create in another. */
+
+typedef struct RequestList RequestList;
+struct RequestList {
+    Request *   head;
+    size_t      count;
+};
+
+static RequestList          Depot[POOL_CLASSES];
+static Mutex                DepotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t        LocalKey;
+static pthread_once_t       LocalOnce = PTHREAD_ONCE_INIT;
+static __thread RequestList Local[POOL_CLASSES];
+static __thread bool        LocalRegistered = false;
+
+/* Internal Functions */
+
+/**
+ * Determine size class for allocation.
+ * @param   size        Number of bytes required.
+ * @return  Size class (or -1 if too large to pool).
+ */
+static int pool_class(size_t size) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (size <= ((size_t)POOL_MINIMUM << c))
+            return c;
+    }
+    return -1;
+}
+
+/**
+ * Move up to n requests from the front of list to the depot (releasing them
+ * to the allocator if the depot is full).
+ * @param   list        Thread's free list.
+ * @param   c           Size class.
+ * @param   n           Number of requests to move.
+ */
+static void pool_release(RequestList *list, int c, size_t n) {
+    Request *head = list->head, *tail = head;
+    size_t   count = 1;
+
+    if (!head)
+        return;
+
+    while (count < n && tail->next) {
+        tail = tail->next;
+        count++;
+    }
+    list->head   = tail->next;
+    list->count -= count;
+    tail->next   = NULL;
+
+    mutex_lock(&DepotLock);
+    if (Depot[c].count < POOL_DEPOT) {
+        tail->next     = Depot[c].head;
+        Depot[c].head  = head;
+        Depot[c].count += count;
+        head = NULL;
+    }
+    mutex_unlock(&DepotLock);
+
+    while (head) {
+        Request *next = head->next;
+        free(head);
+        head = next;
+    }
+}
+
+/**
+ * Return thread's cached requests to the depot when it exits.
+ */
+static void pool_destructor(void *arg) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        while (Local[c].head)
+            pool_release(&Local[c], c, POOL_BATCH);
+    }
+}
+
+static void pool_init() {
+    pthread_key_create(&LocalKey, pool_destructor);
+}
+
+/**
+ * Ensure thread's cached requests are returned to the depot when it exits.
+ */
+static void pool_register() {
+    if (!LocalRegistered) {
+        pthread_once(&LocalOnce, pool_init);
+        pthread_setspecific(LocalKey, Local);
+        LocalRegistered = true;
+    }
+}
+
+/**
+ * Allocate block for request from the pool.
+ * @param   size        Number of bytes required (structure and strings).
+ * @param   capacity    Number of bytes of storage following structure.
+ * @return  Uninitialized Request structure.
+ */
+static Request *pool_get(size_t size, size_t *capacity) {
+    int c = pool_class(size);
+    if (c < 0) {
+        *capacity = size - sizeof(Request);
+        return malloc(size);
+    }
+
+    RequestList *list = &Local[c];
+    if (!list->head && Depot[c].head) {
+        pool_register();
+        mutex_lock(&DepotLock);
+        Request *tail = Depot[c].head;
+        if (tail) {
+            size_t count = 1;
+            while (count < POOL_BATCH && tail->next) {
+                tail = tail->next;
+                count++;
+            }
+            list->head      = Depot[c].head;
+            list->count     = count;
+            Depot[c].head   = tail->next;
+            Depot[c].count -= count;
+            tail->next      = NULL;
+        }
+        mutex_unlock(&DepotLock);
+    }
+
+    Request *r = list->head;
+    if (r) {
+        list->head = r->next;
+        list->count--;
+    } else {
+        r = malloc((size_t)POOL_MINIMUM << c);
+    }
+
+    *capacity = ((size_t)POOL_MINIMUM << c) - sizeof(Request);
+    return r;
+}
+
+/**
+ * Return request block to the pool.
+ * @param   r           Request structure.
+ */
+static void pool_put(Request *r) {
+    int c = pool_class(sizeof(Request) + r->capacity);
+    if (c < 0) {
+        free(r);
+        return;
+    }
+
+    pool_register();
+
+    RequestList *list = &Local[c];
+    r->next    = list->head;
+    list->head = r;
+    if (++list->count > POOL_LOCAL)
+        pool_release(list, c, POOL_BATCH);
+}
+
+/* External Functions */
 
 /**
  * Create Request structure.
@@ -13,30 +194,183 @@
  * @return  Newly allocated Request structure.
  */
 Request * request_create(const char *method, const char *uri, const char *body) {
-    Request * pr = (Request *)malloc(sizeof(Request));
+    return request_create_body(method, uri, body, body ? strlen(body) : 0);
+}
+
+/**
+ * Create Request structure with body of specified length (the method, uri,
+ * and body are stored inline in the same allocation as the structure).
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   body        Request body bytes (need not be NUL-terminated).
+ * @param   length      Length of request body.
+ * @return  Newly allocated Request structure.
+ */
+Request * request_create_body(const char *method, const char *uri, const char *body, size_t length) {
+    size_t mlength = method ? strlen(method) + 1 : 0;
+    size_t ulength = uri    ? strlen(uri)    + 1 : 0;
+    size_t blength = body   ? length         + 1 : 0;
+    size_t capacity;
+
+    Request * pr = pool_get(sizeof(Request) + mlength + ulength + blength, &capacity);
     if (pr)
     {
-        pr->method = method ? strdup(method) : NULL;
-        pr->uri = uri ? strdup(uri) : NULL;
-        pr->body = body ? strdup(body) : NULL;
+        char *data = (char *)(pr + 1);
+
+        pr->method = method ? memcpy(data, method, mlength) : NULL;
+        data += mlength;
+        pr->uri = uri ? memcpy(data, uri, ulength) : NULL;
+        data += ulength;
+        pr->body = body ? memcpy(data, body, length) : NULL;
+        if (body)
+            pr->body[length] = 0;
+
         pr->next = NULL;
+        pr->length = body ? length : 0;
+        pr->capacity = capacity;
+        pr->timestamp = 0;
+        pr->ticket = 0;
+        pr->prefix = NULL;
+        pr->plength = 0;
     }
 
     return pr;
 }
 
 /**
- * Delete Request structure.
+ * Delete Request structure (returning it to the request pool).
  * @param   r           Request structure.
  */
 void request_delete(Request *r) {
     if (r)
-    {
-        free(r->method);
-        free(r->uri);
-        free(r->body);
+        pool_put(r);
+}
+
+/**
+ * Append HTTP Request header to buffer:
+ *
+ *  $METHOD $URI HTTP/1.0\r\n
+ *  [Connection: keep-alive\r\n]
+ *  Content-Length: Length($BODY)\r\n
+ *  \r\n
+ *
+ * Persistent requests ask the server to keep the connection open (so that
+ * further requests can be pipelined behind them) and always carry a
+ * Content-Length header since HTTP/1.0 servers will otherwise close the
+ * connection after the response.  Persistent requests with a prefix copy it
+ * instead of formatting everything before the length.
+ *
+ * @param   r           Request structure.
+ * @param   b           Buffer to append header to.
+ * @param   persistent  Whether or not to request a persistent connection.
+ * @return  Whether or not the header was appended.
+ */
+bool request_format(Request *r, Buffer *b, bool persistent) {
+    static const char KEEPALIVE[] = "Connection: keep-alive\r\n";
+    static const char LENGTH[]    = "Content-Length: ";
+
+    size_t mlength = r->prefix && persistent ? 0 : strlen(r->method);
+    size_t ulength = r->prefix && persistent ? 0 : strlen(r->uri);
+    if (!buffer_reserve(b, mlength + ulength + r->plength + sizeof(KEEPALIVE) + sizeof(LENGTH) + 48))
+        return false;
+
+    char *p = b->data + b->end;
+    if (r->prefix && persistent) {
+        memcpy(p, r->prefix, r->plength);   p += r->plength;
+    } else {
+        memcpy(p, r->method, mlength);      p += mlength;
+        *p++ = ' ';
+        memcpy(p, r->uri, ulength);         p += ulength;
+        memcpy(p, " HTTP/1.0\r\n", 11);     p += 11;
+
+        if (persistent) {
+            memcpy(p, KEEPALIVE, sizeof(KEEPALIVE) - 1);
+            p += sizeof(KEEPALIVE) - 1;
+        }
+
+        if (persistent || r->body) {
+            memcpy(p, LENGTH, sizeof(LENGTH) - 1);
+            p += sizeof(LENGTH) - 1;
+        }
+    }
+
+    if (persistent || r->body) {
+        char   digits[24];
+        size_t ndigits = 0;
+        size_t length  = request_length(r);
+        do {
+            digits[ndigits++] = '0' + length % 10;
+            length /= 10;
+        } while (length);
+
+        while (ndigits)
+            *p++ = digits[--ndigits];
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+
+    *p++ = '\r';
+    *p++ = '\n';
+    b->end = p - b->data;
+    return true;
+}
+
+/**
+ * Format the part of a persistent request's header that does not depend on
+ * its body (everything up to the Content-Length value), so that requests
+ * sharing a method and uri can skip formatting it (by setting prefix).
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   length      Set to the length of the prefix.
+ * @return  Newly allocated prefix string (must be freed; NULL on failure).
+ */
+char *request_prefix(const char *method, const char *uri, size_t *length) {
+    Request r = { .method = (char *)method, .uri = (char *)uri };
+    Buffer  b;
+
+    buffer_init(&b);
+    if (!request_format(&r, &b, true)) {
+        buffer_free(&b);
+        return NULL;
+    }
+
+    /* Drop the length and blank line that end the formatted header */
+    *length = buffer_length(&b) - strlen("0\r\n\r\n");
+    char *prefix = strndup(buffer_head(&b), *length);
+    buffer_free(&b);
+    return prefix;
+}
+
+/**
+ * Write all of the vectors to the file descriptor (retrying partial writes).
+ * @param   fd          File descriptor to write to.
+ * @param   iov         Array of I/O vectors (modified).
+ * @param   n           Number of I/O vectors.
+ * @param   socket      Whether or not the file descriptor is a socket.
+ * @return  Whether or not all the data was written.
+ */
+static bool request_writev(int fd, struct iovec *iov, int n, bool socket) {
+    while (n > 0) {
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t written = socket ? sendmsg(fd, &message, MSG_NOSIGNAL) : writev(fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base  = (char *)iov->iov_base + written;
+            iov->iov_len  -= written;
+        }
     }
-    free(r);
+
+    return true;
 }
 
 /**
@@ -46,17 +380,74 @@ void request_delete(Request *r) {
  *  Content-Length: Length($BODY)\r\n
  *  \r\n
  *  $BODY
- *      
+ *
+ * The header and body are written with a single writev on the underlying
+ * file descriptor (after flushing anything already buffered in the stream).
+ *
  * @param   r           Request structure.
  * @param   fs          Socket file stream.
  */
 void request_write(Request *r, FILE *fs) {
-    fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
-    if (r->body)
-        fprintf(fs, "Content-Length: %ld\r\n", strlen(r->body));
-    fprintf(fs, "\r\n");
-    if (r->body)
-        fprintf(fs, "%s", r->body);
+    Buffer header;
+    buffer_init(&header);
+
+    if (request_format(r, &header, false)) {
+        struct iovec iov[2] = {
+            { buffer_head(&header), buffer_length(&header) },
+            { r->body, request_length(r) },
+        };
+
+        fflush(fs);
+        request_writev(fileno(fs), iov, r->body ? 2 : 1, false);
+    }
+
+    buffer_free(&header);
+}
+
+/**
+ * Send persistent HTTP Requests to socket, coalescing all of their headers
+ * and bodies into as few sendmsg calls as possible.
+ * @param   requests    Array of Request structures.
+ * @param   n           Number of requests.
+ * @param   headers     Scratch buffer for formatting headers (reused).
+ * @param   fd          Socket file descriptor.
+ * @return  Whether or not all the requests were sent.
+ */
+bool request_send(Request **requests, size_t n, Buffer *headers, int fd) {
+    struct iovec iov[SEND_VECTORS];
+    size_t       offsets[SEND_VECTORS / 2 + 1];
+
+    for (size_t first = 0; first < n; ) {
+        size_t count = n - first < SEND_VECTORS / 2 ? n - first : SEND_VECTORS / 2;
+
+        /* Format headers first (the buffer may move as it grows) */
+        buffer_consume(headers, buffer_length(headers));
+        for (size_t i = 0; i < count; i++) {
+            offsets[i] = headers->end;
+            if (!request_format(requests[first + i], headers, true))
+                return false;
+        }
+        offsets[count] = headers->end;
+
+        int niov = 0;
+        for (size_t i = 0; i < count; i++) {
+            Request *r = requests[first + i];
+            iov[niov].iov_base = headers->data + offsets[i];
+            iov[niov].iov_len  = offsets[i + 1] - offsets[i];
+            niov++;
+            if (request_length(r)) {
+                iov[niov].iov_base = r->body;
+                iov[niov].iov_len  = request_length(r);
+                niov++;
+            }
+        }
+
+        if (!request_writev(fd, iov, niov, true))
+            return false;
+        first += count;
+    }
+
+    return true;
 }
 
-/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */ 
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,16 +6,125 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+/* Internal Functions */
+
+/**
+ * Fill in address of Unix domain socket endpoint: unix:/path names a socket
+ * in the filesystem while unix:@name names one in the abstract namespace
+ * (which needs no file and disappears with the last socket bound to it).
+ * @param   host        Host string beginning with SOCKET_UNIX.
+ * @param   address     Unix domain socket address structure to fill in.
+ * @param   length      Set to the length of the address.
+ * @return  Whether or not the endpoint is a valid address.
+ */
+static bool socket_unix_address(const char *host, struct sockaddr_un *address, socklen_t *length) {
+    const char *path    = host + sizeof(SOCKET_UNIX) - 1;
+    size_t      plength = strlen(path);
+
+    if (plength < 2 || plength >= sizeof(address->sun_path)) {
+        errno = plength < 2 ? EINVAL : ENAMETOOLONG;
+        return false;
+    }
+
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, plength);
+
+    /* Abstract names start with a NUL byte and are not NUL-terminated */
+    if (path[0] == '@') {
+        address->sun_path[0] = 0;
+        *length = offsetof(struct sockaddr_un, sun_path) + plength;
+    } else {
+        *length = offsetof(struct sockaddr_un, sun_path) + plength + 1;
+    }
+    return true;
+}
+
 /**
- * Create socket connection to specified host and port.
+ * Create socket connection to Unix domain socket endpoint.
+ * @param   host    Host string beginning with SOCKET_UNIX.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+static int socket_unix_connect(const char *host) {
+    struct sockaddr_un address;
+    socklen_t          length;
+
+    if (!socket_unix_address(host, &address, &length)) {
+        error("Unable to connect to %s: %s", host, strerror(errno));
+        return -1;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        error("Unable to make socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(socket_fd, (struct sockaddr *)&address, length) < 0) {
+        error("Unable to connect to %s: %s", host, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Create non-blocking listening socket bound to Unix domain socket endpoint
+ * (replacing any stale socket file left at its path).
+ * @param   host    Host string beginning with SOCKET_UNIX.
+ * @return  Socket file descriptor if successful, otherwise -1.
+ */
+static int socket_unix_listen(const char *host) {
+    struct sockaddr_un address;
+    socklen_t          length;
+    struct stat        st;
+
+    if (!socket_unix_address(host, &address, &length)) {
+        error("Unable to listen on %s: %s", host, strerror(errno));
+        return -1;
+    }
+
+    if (address.sun_path[0] && stat(address.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(address.sun_path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socket_fd < 0) {
+        error("Unable to make socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (bind(socket_fd, (struct sockaddr *)&address, length) < 0 ||
+        listen(socket_fd, SOMAXCONN) < 0) {
+        error("Unable to listen on %s: %s", host, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/* External Functions */
+
+/**
+ * Create socket connection to specified host and port (or to the Unix domain
+ * socket named by a host beginning with SOCKET_UNIX, ignoring port).
  * @param   host    Host string to connect to.
  * @param   port    Port string to connect to.
- * @return  Socket file stream of connection if successful, otherwise NULL.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
  */
-FILE *  socket_connect(const char *host, const char *port) {
+int     socket_connect(const char *host, const char *port) {
+    if (socket_is_unix(host))
+        return socket_unix_connect(host);
+
     /* Lookup server address information */
     struct addrinfo *results;
     struct addrinfo  hints = {
@@ -25,7 +134,7 @@ FILE *  socket_connect(const char *host, const char *port) {
     int status;
     if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
         error("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
-        return NULL;
+        return -1;
     }
 
     /* For each server entry, allocate socket and try to connect */
@@ -50,16 +159,67 @@ FILE *  socket_connect(const char *host, const char *port) {
 
     if (socket_fd < 0) {
         error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
-        return NULL;
+        return -1;
     }
 
-    /* Make file stream */
-    FILE *fs = fdopen(socket_fd, "r+");
-    if (!fs) {
-        error("Unable to make file stream: %s", strerror(errno));
-        close(socket_fd);
+    /* Requests are coalesced before sending, so do not delay small writes */
+    int on = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return socket_fd;
+}
+
+/**
+ * Create non-blocking listening socket bound to specified host and port (or
+ * to the Unix domain socket named by a host beginning with SOCKET_UNIX,
+ * ignoring port).
+ * @param   host    Host string to bind to (NULL for any address).
+ * @param   port    Port string to bind to.
+ * @return  Socket file descriptor if successful, otherwise -1.
+ */
+int     socket_listen(const char *host, const char *port) {
+    if (socket_is_unix(host))
+        return socket_unix_listen(host);
+
+    /* Lookup server address information */
+    struct addrinfo *results;
+    struct addrinfo  hints = {
+	.ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
+	.ai_socktype = SOCK_STREAM, /* Use TCP */
+	.ai_flags    = AI_PASSIVE,  /* Use all interfaces */
+    };
+    int status;
+    if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
+        error("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
+        return -1;
+    }
+
+    /* For each server entry, allocate socket and try to bind and listen */
+    int socket_fd = -1;
+    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+        /* Allocate socket */
+        if ((socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0) {
+            error("Unable to make socket: %s", strerror(errno));
+            continue;
+        }
+
+        /* Bind to address and listen */
+        int on = 1;
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0 ||
+            listen(socket_fd, SOMAXCONN) < 0) {
+            close(socket_fd);
+            socket_fd = -1;
+            continue;
+        }
+    }
+
+    /* Release allocate address information */
+    freeaddrinfo(results);
+
+    if (socket_fd < 0) {
+        error("Unable to listen on %s:%s: %s", host ? host : "*", port, strerror(errno));
     }
-    return fs;
+    return socket_fd;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,6 +1,7 @@
 /* echo_client.c: Message Queue Echo Client test */
 
 #include "mq/client.h"
+#include "mq/string.h"
 
 #include <assert.h>
 #include <time.h>
@@ -9,14 +10,41 @@
 /* Constants */
 
 const char * TOPIC     = "testing";
+const size_t NOBODY    = 512;	// Length of topic nobody subscribes to (longer than any fixed uri buffer)
 const size_t NMESSAGES = 10;
 
+/* Globals */
+
+size_t Acked    = 0;	// Asynchronous publishes acknowledged with 200
+size_t Rejected = 0;	// Asynchronous publishes acknowledged with 404
+size_t Tickets  = 0;	// Sum of acknowledged tickets
+size_t Consumed = 0;	// Messages handed to consumer workers
+
+/* Functions */
+
+void ack_handler(MessageQueue *mq, const MessageQueueAck *acks, size_t n, void *arg) {
+    assert(arg == &Acked);
+    for (size_t a = 0; a < n; a++) {
+    	assert(acks[a].status == 200 || acks[a].status == 404);
+    	__atomic_fetch_add(acks[a].status == 200 ? &Acked : &Rejected, 1, __ATOMIC_RELAXED);
+    	__atomic_fetch_add(&Tickets, acks[a].ticket, __ATOMIC_RELAXED);
+    }
+}
+
+void consume_handler(MessageQueue *mq, const char *message, void *arg) {
+    assert(arg == &Consumed);
+    assert(strstr(message, "Hello from"));
+    __atomic_fetch_add(&Consumed, 1, __ATOMIC_RELAXED);
+}
+
 /* Threads */
 
 void *incoming_thread(void *arg) {
     MessageQueue *mq = (MessageQueue *)arg;
     size_t messages = 0;
 
+    char *batch[4];
+
     while (!mq_shutdown(mq)) {
     	char *message = mq_retrieve(mq);
 	if (message) {
@@ -24,6 +52,14 @@ void *incoming_thread(void *arg) {
 	    free(message);
 	    messages++;
 	}
+
+	/* Alternate with retrieving batches */
+	size_t n = mq_retrieve_many(mq, 4, batch);
+	for (size_t m = 0; m < n; m++) {
+	    assert(strstr(batch[m], "Hello from"));
+	    free(batch[m]);
+	}
+	messages += n;
     }
 
     assert(messages == NMESSAGES);
@@ -34,12 +70,39 @@ void *outgoing_thread(void *arg) {
     MessageQueue *mq = (MessageQueue *)arg;
     char body[BUFSIZ];
 
-    for (size_t i = 0; i < NMESSAGES; i++) {
+    char batch[NMESSAGES / 2][BUFSIZ];
+    const char *bodies[NMESSAGES / 2];
+
+    MessageQueueTopic *topic = mq_topic_open(mq, TOPIC);
+    assert(topic && mq_topic_open(mq, TOPIC) == topic);
+
+    for (size_t i = 0; i < NMESSAGES - NMESSAGES / 2; i++) {
     	sprintf(body, "%lu. Hello from %lu\n", i, time(NULL));
-    	mq_publish(mq, TOPIC, body);
+    	if (i % 2)
+    	    assert(mq_publish_h(topic, body, strlen(body)));
+    	else
+    	    assert(mq_publish_async(mq, TOPIC, body) > 0);
     }
 
-    sleep(5);
+    /* Nobody is subscribed, so the broker answers 404 */
+    char nobody[NOBODY + 1];
+    memset(nobody, 'x', NOBODY);
+    nobody[NOBODY] = 0;
+    assert(mq_publish_async(mq, nobody, "") > 0);
+
+    for (size_t i = 0; i < NMESSAGES / 2; i++) {
+    	sprintf(batch[i], "%lu. Hello from %lu\n", NMESSAGES - NMESSAGES / 2 + i, time(NULL));
+    	bodies[i] = batch[i];
+    }
+    mq_publish_batch(mq, TOPIC, bodies, NMESSAGES / 2);
+
+    /* Stop once everything has been retrieved (mq_stop waits for the answers
+     * to publishes still in flight) */
+    MessageQueueStats stats;
+    do {
+    	usleep(1000);
+    	mq_stats(mq, &stats);
+    } while (stats.retrieved < NMESSAGES);
     mq_stop(mq);
     return NULL;
 }
@@ -51,13 +114,23 @@ int main(int argc, char *argv[]) {
     char *name = getenv("USER");
     char *host = "localhost";
     char *port = "9620";
+    MessageQueueOptions options = {
+    	.ack_handler = ack_handler,
+    	.ack_arg     = &Acked,
+    };
 
     if (argc > 1) { host = argv[1]; }
     if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { options.reactor = strstr(argv[3], "reactor") != NULL; }
+    if (argc > 3) { options.connections = strstr(argv[3], "pool") ? 2 : 0; }
+    if (argc > 3) { options.stream = strstr(argv[3], "stream") != NULL; }
+    if (argc > 3) { options.prefetch = strstr(argv[3], "prefetch") ? 4 : 0; }
+    if (argc > 3) { options.ring_capacity = strstr(argv[3], "ring") ? 4 : 0; }
+    bool consume = argc > 3 && strstr(argv[3], "consume");
     if (!name)    { name = "echo_client_test";  }
 
     /* Create and start message queue */
-    MessageQueue *mq = mq_create(name, host, port);
+    MessageQueue *mq = mq_create_with_options(name, host, port, &options);
     assert(mq);
 
     mq_subscribe(mq, TOPIC);
@@ -65,13 +138,42 @@ int main(int argc, char *argv[]) {
     mq_subscribe(mq, TOPIC);
     mq_start(mq);
 
-    /* Run and wait for incoming and outgoing threads */
+    /* Subscriptions travel on the retriever, so wait for them before publishing */
+    MessageQueueStats stats;
+    do {
+    	usleep(1000);
+    	mq_stats(mq, &stats);
+    } while (stats.responses[MQ_REQUEST_SUBSCRIPTION] < 3);
+
+    /* Run and wait for incoming (or consumer workers) and outgoing threads */
     Thread incoming;
     Thread outgoing;
-    thread_create(&incoming, NULL, incoming_thread, mq);
+    if (consume)
+    	assert(mq_consume(mq, consume_handler, &Consumed, 4));
+    else
+    	thread_create(&incoming, NULL, incoming_thread, mq);
     thread_create(&outgoing, NULL, outgoing_thread, mq);
-    thread_join(incoming, NULL);
+    if (!consume)
+    	thread_join(incoming, NULL);
     thread_join(outgoing, NULL);
+    assert(!consume || Consumed == NMESSAGES);
+
+    /* Check statistics */
+    mq_stats(mq, &stats);
+    assert(stats.published == NMESSAGES + 1);
+    assert(stats.retrieved == NMESSAGES);
+    assert(stats.retrieved_bytes == stats.published_bytes);
+    assert(stats.outgoing == 0);
+    assert(stats.responses[MQ_REQUEST_SUBSCRIPTION] == 3);
+    assert(stats.errors[MQ_REQUEST_SUBSCRIPTION] == 0);
+    assert(stats.rtt[MQ_REQUEST_PUBLISH].count == NMESSAGES - NMESSAGES / 2 + 2);
+    assert(stats.errors[MQ_REQUEST_PUBLISH] == 1);
+
+    /* Check acknowledgements (tickets are numbered from one) */
+    size_t async = (NMESSAGES - NMESSAGES / 2 + 1) / 2;
+    assert(stats.acked == async + 1);
+    assert(Acked == async && Rejected == 1);
+    assert(Tickets == (async + 1) * (async + 2) / 2);
 
     mq_delete(mq);
     return 0;
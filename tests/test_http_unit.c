@@ -0,0 +1,339 @@
+/* test_http_unit.c: Test HTTP parsing (Unit) */
+
+#include "mq/http.h"
+#include "mq/logging.h"
+#include "mq/string.h"
+
+#include <assert.h>
+
+/* Constants */
+
+const char *RESPONSE =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Length: 12\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n"
+    "SOME LIKE IT";
+
+const char *RESPONSES =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 7\r\n"
+    "\r\n"
+    "FOREVER"
+    "HTTP/1.1 404 Not Found\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/* Functions */
+
+int test_00_http_parse_response() {
+    HTTPParser p;
+    Request   *r = NULL;
+    int        flags = 0;
+
+    http_parser_init(&p);
+    ssize_t n = http_parse_response(&p, RESPONSE, strlen(RESPONSE), &r, &flags);
+    assert(n == (ssize_t)strlen(RESPONSE));
+    assert(r);
+    assert(streq(r->method, "200"));
+    assert(streq(r->uri, "OK"));
+    assert(streq(r->body, "SOME LIKE IT"));
+    assert(r->length == 12);
+    assert(flags == HTTP_KEEPALIVE);
+
+    request_delete(r);
+    return EXIT_SUCCESS;
+}
+
+int test_01_http_parse_incremental() {
+    HTTPParser p;
+    Request   *r = NULL;
+    int        flags = 0;
+    size_t     length = strlen(RESPONSE);
+
+    /* Feed one more byte at a time: nothing is parsed until all arrive */
+    http_parser_init(&p);
+    for (size_t i = 0; i < length; i++) {
+        assert(http_parse_response(&p, RESPONSE, i, &r, &flags) == 0);
+        assert(r == NULL);
+    }
+
+    assert(http_parse_response(&p, RESPONSE, length, &r, &flags) == (ssize_t)length);
+    assert(r);
+    assert(streq(r->body, "SOME LIKE IT"));
+
+    request_delete(r);
+    return EXIT_SUCCESS;
+}
+
+int test_02_http_parse_multiple() {
+    HTTPParser  p;
+    Request    *r = NULL;
+    int         flags = 0;
+    const char *data = RESPONSES;
+    size_t      length = strlen(RESPONSES);
+
+    http_parser_init(&p);
+    ssize_t n = http_parse_response(&p, data, length, &r, &flags);
+    assert(n > 0);
+    assert(streq(r->method, "200"));
+    assert(streq(r->body, "FOREVER"));
+    assert(flags == (HTTP_KEEPALIVE | HTTP_VERSION_11));
+    request_delete(r);
+
+    data += n;
+    length -= n;
+    n = http_parse_response(&p, data, length, &r, &flags);
+    assert(n == (ssize_t)length);
+    assert(streq(r->method, "404"));
+    assert(streq(r->uri, "Not Found"));
+    assert(streq(r->body, ""));
+    assert(flags == HTTP_VERSION_11);
+    request_delete(r);
+
+    return EXIT_SUCCESS;
+}
+
+int test_03_http_parse_large() {
+    HTTPParser p;
+    Buffer     b;
+    Request   *r = NULL;
+    int        flags = 0;
+    size_t     length = 1<<16;
+    char      *body = malloc(length);
+
+    memset(body, 'x', length);
+    buffer_init(&b);
+    assert(http_write_response(&b, 200, body, length, HTTP_KEEPALIVE));
+
+    http_parser_init(&p);
+    assert(http_parse_response(&p, buffer_head(&b), buffer_length(&b) - 1, &r, &flags) == 0);
+    assert(http_parse_response(&p, buffer_head(&b), buffer_length(&b), &r, &flags) == (ssize_t)buffer_length(&b));
+    assert(r->length == length);
+    assert(memcmp(r->body, body, length) == 0);
+    assert(flags == HTTP_KEEPALIVE);
+
+    request_delete(r);
+    buffer_free(&b);
+    free(body);
+    return EXIT_SUCCESS;
+}
+
+int test_04_http_parse_request() {
+    const char *data =
+        "PUT /topic/HOT HTTP/1.0\r\n"
+        "Content-Length: 12\r\n"
+        "\r\n"
+        "SOME LIKE IT";
+    HTTPParser p;
+    Request   *r = NULL;
+    int        flags = 0;
+
+    http_parser_init(&p);
+    assert(http_parse_request(&p, data, strlen(data), &r, &flags) == (ssize_t)strlen(data));
+    assert(streq(r->method, "PUT"));
+    assert(streq(r->uri, "/topic/HOT"));
+    assert(streq(r->body, "SOME LIKE IT"));
+    assert(flags == 0);
+    request_delete(r);
+
+    data = "GET /queue/LIVE HTTP/1.1\r\n\r\n";
+    assert(http_parse_request(&p, data, strlen(data), &r, &flags) == (ssize_t)strlen(data));
+    assert(streq(r->method, "GET"));
+    assert(r->body == NULL);
+    assert(flags == (HTTP_KEEPALIVE | HTTP_VERSION_11));
+    request_delete(r);
+
+    data = "GARBAGE\r\n\r\n";
+    assert(http_parse_request(&p, data, strlen(data), &r, &flags) < 0);
+    return EXIT_SUCCESS;
+}
+
+int test_05_http_frame_append() {
+    Buffer b;
+
+    buffer_init(&b);
+    assert(http_frame_append(&b, "SOME", 4));
+    assert(http_frame_append(&b, "", 0));
+    assert(http_frame_append(&b, "LIKE IT HOT", 11));
+    assert(buffer_length(&b) == strlen("4\nSOME0\n11\nLIKE IT HOT"));
+    assert(memcmp(buffer_head(&b), "4\nSOME0\n11\nLIKE IT HOT", buffer_length(&b)) == 0);
+
+    buffer_free(&b);
+    return EXIT_SUCCESS;
+}
+
+int test_06_http_frame_next() {
+    const char *data   = "4\nSOME0\n11\nLIKE IT HOT";
+    size_t      length = strlen(data);
+    const char *frame;
+    size_t      flength;
+
+    assert(http_frame_next(data, length, &frame, &flength) == 6);
+    assert(flength == 4 && memcmp(frame, "SOME", 4) == 0);
+    data += 6; length -= 6;
+
+    assert(http_frame_next(data, length, &frame, &flength) == 2);
+    assert(flength == 0);
+    data += 2; length -= 2;
+
+    assert(http_frame_next(data, length, &frame, &flength) == (ssize_t)length);
+    assert(flength == 11 && memcmp(frame, "LIKE IT HOT", 11) == 0);
+
+    assert(http_frame_next("12\nSHORT", 8, &frame, &flength) < 0);
+    assert(http_frame_next("12", 2, &frame, &flength) < 0);
+    assert(http_frame_next("\nX", 2, &frame, &flength) < 0);
+    assert(http_frame_next("-1\nX", 4, &frame, &flength) < 0);
+    assert(http_frame_next("99999999999999999999999\nX", 25, &frame, &flength) < 0);
+    return EXIT_SUCCESS;
+}
+
+int test_07_http_parse_chunked() {
+    const char *stream =
+        "HTTP/1.1 200 OK\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        "6\r\n4\nSOME\r\n";
+    HTTPParser  p;
+    Request    *r = NULL;
+    int         flags = 0;
+
+    /* Header is returned alone: the chunks that follow are not consumed */
+    http_parser_init(&p);
+    ssize_t n = http_parse_response(&p, stream, strlen(stream), &r, &flags);
+    assert(n == (ssize_t)(strlen(stream) - strlen("6\r\n4\nSOME\r\n")));
+    assert(r && streq(r->method, "200") && r->length == 0);
+    assert(flags == (HTTP_KEEPALIVE | HTTP_VERSION_11 | HTTP_CHUNKED));
+    request_delete(r);
+
+    /* Chunked requests are rejected */
+    const char *request = "PUT /topic/HOT HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+    r = NULL;
+    http_parser_init(&p);
+    assert(http_parse_request(&p, request, strlen(request), &r, &flags) < 0);
+    assert(r == NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_08_http_chunk_next() {
+    Buffer      b;
+    const char *chunk;
+    size_t      clength;
+
+    buffer_init(&b);
+    assert(http_chunk_begin(&b, http_frame_length(4) + http_frame_length(11)));
+    assert(http_frame_append(&b, "SOME", 4));
+    assert(http_frame_append(&b, "LIKE IT HOT", 11));
+    assert(http_chunk_end(&b));
+    assert(http_chunk_begin(&b, 0));
+    assert(http_chunk_end(&b));
+
+    const char *data   = buffer_head(&b);
+    size_t      length = buffer_length(&b);
+    assert(length == strlen("14\r\n4\nSOME11\nLIKE IT HOT\r\n0\r\n\r\n"));
+    assert(memcmp(data, "14\r\n4\nSOME11\nLIKE IT HOT\r\n0\r\n\r\n", length) == 0);
+
+    /* Incomplete chunks are not consumed */
+    for (size_t i = 0; i < 26; i++)
+        assert(http_chunk_next(data, i, &chunk, &clength) == 0);
+
+    assert(http_chunk_next(data, length, &chunk, &clength) == 26);
+    assert(clength == 20 && memcmp(chunk, "4\nSOME11\nLIKE IT HOT", 20) == 0);
+    assert(http_chunk_next(data + 26, length - 26, &chunk, &clength) == 5);
+    assert(clength == 0);
+
+    assert(http_chunk_next("1;ext=1\r\nX\r\n", 12, &chunk, &clength) == 12);
+    assert(clength == 1 && *chunk == 'X');
+    assert(http_chunk_next("Z\r\nX\r\n", 6, &chunk, &clength) < 0);
+    assert(http_chunk_next("1\r\nXY\r\n", 7, &chunk, &clength) < 0);
+
+    buffer_free(&b);
+    return EXIT_SUCCESS;
+}
+
+int test_09_http_parse_limits() {
+    HTTPParser p;
+    Request   *r = NULL;
+    int        flags = 0;
+
+    /* Content-Length must be a plain (not absurdly long) number */
+    const char *malformed[] = {
+        "PUT /topic/t HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+        "PUT /topic/t HTTP/1.1\r\nContent-Length: 4abc\r\n\r\nBODY",
+        "PUT /topic/t HTTP/1.1\r\nContent-Length: \r\n\r\n",
+        "PUT /topic/t HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n",
+        NULL,
+    };
+    for (const char **data = malformed; *data; data++) {
+        http_parser_init(&p);
+        assert(http_parse_request(&p, *data, strlen(*data), &r, &flags) == -1);
+    }
+
+    const char *data = "PUT /topic/t HTTP/1.1\r\nContent-Length: 4 \r\n\r\nBODY";
+    http_parser_init(&p);
+    assert(http_parse_request(&p, data, strlen(data), &r, &flags) == (ssize_t)strlen(data));
+    assert(r->length == 4 && memcmp(r->body, "BODY", 4) == 0);
+    request_delete(r);
+
+    /* Request bodies are limited, response bodies are not */
+    char large[BUFSIZ];
+    sprintf(large, "PUT /topic/t HTTP/1.1\r\nContent-Length: %d\r\n\r\n", HTTP_BODY_MAX + 1);
+    http_parser_init(&p);
+    assert(http_parse_request(&p, large, strlen(large), &r, &flags) == HTTP_TOO_LARGE);
+
+    sprintf(large, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", HTTP_BODY_MAX + 1);
+    http_parser_init(&p);
+    assert(http_parse_response(&p, large, strlen(large), &r, &flags) == 0);
+
+    /* Header blocks are limited whether or not they are complete */
+    size_t length = HTTP_HEADER_MAX + 1;
+    char  *header = malloc(length);
+    memset(header, 'x', length);
+    http_parser_init(&p);
+    assert(http_parse_request(&p, header, length, &r, &flags) == HTTP_TOO_LARGE);
+    free(header);
+
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test http_parse_response\n");
+        fprintf(stderr, "    1. Test http_parse_response (incremental)\n");
+        fprintf(stderr, "    2. Test http_parse_response (multiple)\n");
+        fprintf(stderr, "    3. Test http_parse_response (large body)\n");
+        fprintf(stderr, "    4. Test http_parse_request\n");
+        fprintf(stderr, "    5. Test http_frame_append\n");
+        fprintf(stderr, "    6. Test http_frame_next\n");
+        fprintf(stderr, "    7. Test http_parse_response (chunked)\n");
+        fprintf(stderr, "    8. Test http_chunk_next\n");
+        fprintf(stderr, "    9. Test http_parse_request (limits)\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_http_parse_response(); break;
+        case 1:  status = test_01_http_parse_incremental(); break;
+        case 2:  status = test_02_http_parse_multiple(); break;
+        case 3:  status = test_03_http_parse_large(); break;
+        case 4:  status = test_04_http_parse_request(); break;
+        case 5:  status = test_05_http_frame_append(); break;
+        case 6:  status = test_06_http_frame_next(); break;
+        case 7:  status = test_07_http_parse_chunked(); break;
+        case 8:  status = test_08_http_chunk_next(); break;
+        case 9:  status = test_09_http_parse_limits(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
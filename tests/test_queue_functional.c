@@ -12,6 +12,7 @@
 const size_t NCONSUMERS = 2;
 const size_t NPRODUCERS = 4;
 const size_t NMESSAGES  = 1<<10;
+const size_t CAPACITY   = (NPRODUCERS - NCONSUMERS) * NMESSAGES;    // Room for unconsumed messages
 
 /* Threads */
 
@@ -62,10 +63,9 @@ void *producer(void *arg) {
 
 /* Main execution */
 
-int main(int arg, char *argv[]) {
+void test_queue(Queue *q) {
     Thread consumers[NCONSUMERS];
     Thread producers[NPRODUCERS];
-    Queue *q = queue_create();
 
     for (size_t c = 0; c < NCONSUMERS; c++) {
     	thread_create(&consumers[c], NULL, consumer, q);
@@ -84,6 +84,11 @@ int main(int arg, char *argv[]) {
     }
 
     queue_delete(q);
+}
+
+int main(int arg, char *argv[]) {
+    test_queue(queue_create());
+    test_queue(queue_create_ring(CAPACITY));
     return EXIT_SUCCESS;
 }
 
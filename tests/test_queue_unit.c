@@ -6,6 +6,9 @@
 #include "mq/string.h"
 
 #include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 /* Constants */
 
@@ -85,6 +88,298 @@ int test_03_queue_delete() {
     return EXIT_SUCCESS;
 }
 
+int test_04_queue_create_ring() {
+    Queue *q = queue_create_ring(5);
+    assert(q);
+    assert(q->ring);
+    assert(q->size == 0);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_05_queue_ring() {
+    Queue *q = queue_create_ring(4);
+    assert(q);
+
+    /* Wrap around the ring several times, keeping it full each round */
+    for (size_t round = 0; round < 3; round++) {
+        for (size_t r = 0; r < 4; r++) {
+            queue_push(q, &REQUESTS[r]);
+            assert(q->size == r + 1);
+        }
+
+        for (size_t r = 0; r < 4; r++) {
+            assert(queue_pop(q) == &REQUESTS[r]);
+            assert(q->size == 3 - r);
+        }
+    }
+
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+        queue_push(q, request_create(REQUESTS[r].method, REQUESTS[r].uri, REQUESTS[r].body));
+        if (q->size == 4)
+            request_delete(queue_pop(q));
+    }
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_06_queue_push_all() {
+    Queue *queues[] = { queue_create(), queue_create_ring(8), NULL };
+
+    for (Queue **q = queues; *q; q++) {
+        /* Link all requests after the first and push them at once */
+        queue_push(*q, &REQUESTS[0]);
+        for (size_t r = 1; REQUESTS[r].method; r++)
+            REQUESTS[r].next = REQUESTS[r + 1].method ? &REQUESTS[r + 1] : NULL;
+        queue_push_all(*q, &REQUESTS[1]);
+        assert((*q)->size == 5);
+
+        for (size_t r = 0; REQUESTS[r].method; r++)
+            assert(queue_pop(*q) == &REQUESTS[r]);
+        assert((*q)->size == 0);
+
+        queue_push_all(*q, NULL);
+        assert((*q)->size == 0);
+        queue_delete(*q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_07_queue_try_pop() {
+    Queue *queues[] = { queue_create(), queue_create_ring(8), NULL };
+
+    for (Queue **q = queues; *q; q++) {
+        assert(queue_try_pop(*q) == NULL);
+
+        for (size_t r = 0; r < 3; r++)
+            queue_push(*q, &REQUESTS[r]);
+
+        for (size_t r = 0; r < 3; r++) {
+            assert(queue_try_pop(*q) == &REQUESTS[r]);
+            assert((*q)->size == 2 - r);
+        }
+
+        assert(queue_try_pop(*q) == NULL);
+        queue_delete(*q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_08_queue_pop_batch() {
+    Queue *queues[] = { queue_create(), queue_create_ring(8), NULL };
+    Request *batch[4];
+
+    for (Queue **q = queues; *q; q++) {
+        for (size_t r = 0; REQUESTS[r].method; r++)
+            queue_push(*q, &REQUESTS[r]);
+
+        assert(queue_pop_batch(*q, batch, 3) == 3);
+        for (size_t r = 0; r < 3; r++)
+            assert(batch[r] == &REQUESTS[r]);
+        assert((*q)->size == 2);
+
+        assert(queue_pop_batch(*q, batch, 4) == 2);
+        assert(batch[0] == &REQUESTS[3]);
+        assert(batch[1] == &REQUESTS[4]);
+        assert((*q)->size == 0);
+
+        queue_push(*q, &REQUESTS[0]);
+        assert(queue_pop_batch(*q, batch, 4) == 1);
+        assert(batch[0] == &REQUESTS[0]);
+        queue_delete(*q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_09_queue_pop_all() {
+    Queue *queues[] = { queue_create(), queue_create_ring(8), NULL };
+
+    for (Queue **q = queues; *q; q++) {
+        for (size_t r = 0; REQUESTS[r].method; r++)
+            queue_push(*q, &REQUESTS[r]);
+
+        Request *head = queue_pop_all(*q);
+        assert((*q)->size == 0);
+        assert(queue_try_pop(*q) == NULL);
+
+        size_t r = 0;
+        for (; head; head = head->next, r++)
+            assert(head == &REQUESTS[r]);
+        assert(r == 5);
+
+        /* Queue remains usable after being emptied */
+        queue_push(*q, &REQUESTS[1]);
+        assert((*q)->size == 1);
+        head = queue_pop_all(*q);
+        assert(head == &REQUESTS[1] && head->next == NULL);
+        queue_delete(*q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_10_queue_pop_timed() {
+    Queue *queues[] = { queue_create(), queue_create_ring(8), NULL };
+
+    for (Queue **q = queues; *q; q++) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        assert(queue_pop_timed(*q, &deadline) == NULL);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        assert(now.tv_sec > deadline.tv_sec ||
+               (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec));
+
+        queue_push(*q, &REQUESTS[2]);
+        assert(queue_pop_timed(*q, &deadline) == &REQUESTS[2]);
+        assert((*q)->size == 0);
+        queue_delete(*q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int test_11_queue_bounded_fail() {
+    Queue *q = queue_create_bounded(2, 0, QUEUE_FAIL);
+    Request get = { "GET", "u", NULL };
+    assert(q);
+
+    assert(queue_push(q, &REQUESTS[0]));
+    assert(queue_push(q, &REQUESTS[1]));
+    assert(q->size == 2 && q->bytes == 4);
+
+    assert(!queue_push(q, &REQUESTS[2]));
+    assert(q->size == 2 && q->rejected == 1);
+
+    /* Requests without a body are always admitted */
+    assert(queue_push(q, &get));
+    assert(q->size == 3 && q->bytes == 4);
+
+    assert(queue_pop(q) == &REQUESTS[0]);
+    assert(q->bytes == 2);
+    assert(queue_pop(q) == &REQUESTS[1]);
+    assert(queue_pop(q) == &get);
+    assert(queue_push(q, &REQUESTS[2]));
+    assert(queue_pop(q) == &REQUESTS[2]);
+
+    assert(q->size == 0 && q->bytes == 0);
+    assert(q->peak_size == 3 && q->peak_bytes == 4);
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_12_queue_bounded_drop_oldest() {
+    Queue *q = queue_create_bounded(0, 8, QUEUE_DROP_OLDEST);
+    char body[BUFSIZ];
+    assert(q);
+
+    /* Sentinel without a body is never evicted */
+    assert(queue_push(q, request_create("GET", "/queue/q", NULL)));
+    for (size_t r = 0; r < 6; r++) {
+        sprintf(body, "b%lu", r);
+        assert(queue_push(q, request_create("PUT", "/topic/t", body)));
+        assert(q->bytes <= 8);
+    }
+
+    assert(q->size == 5 && q->bytes == 8 && q->dropped == 2);
+
+    Request *r = queue_pop(q);
+    assert(streq(r->method, "GET"));
+    request_delete(r);
+    for (size_t n = 2; n < 6; n++) {
+        sprintf(body, "b%lu", n);
+        r = queue_pop(q);
+        assert(streq(r->body, body));
+        request_delete(r);
+    }
+
+    assert(q->size == 0 && q->bytes == 0 && q->peak_bytes == 8);
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+void *test_13_pusher(void *arg) {
+    Queue *q = (Queue *)arg;
+    for (size_t r = 0; REQUESTS[r].method; r++)
+        assert(queue_push(q, &REQUESTS[r]));
+    return NULL;
+}
+
+int test_13_queue_bounded_block() {
+    Queue *q = queue_create_bounded(2, 0, QUEUE_BLOCK);
+    Thread pusher;
+    assert(q);
+
+    thread_create(&pusher, NULL, test_13_pusher, q);
+    for (size_t r = 0; REQUESTS[r].method; r++) {
+        assert(queue_pop(q) == &REQUESTS[r]);
+        assert(q->size <= 2);
+    }
+    thread_join(pusher, NULL);
+
+    assert(q->size == 0 && q->peak_size <= 2);
+    assert(q->rejected == 0 && q->dropped == 0);
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+#define NPUSHED 20000
+
+Request PUSHED[NPUSHED];
+
+void *test_14_pusher(void *arg) {
+    Queue *q = (Queue *)arg;
+    for (size_t r = 0; r < NPUSHED; r++)
+        assert(queue_push(q, &PUSHED[r]));
+    return NULL;
+}
+
+int test_14_queue_try_pop_all() {
+    Queue *queues[] = { queue_create(), queue_create_ring(2), NULL };
+
+    for (Queue **q = queues; *q; q++) {
+        assert(queue_try_pop_all(*q) == NULL);
+
+        /* Drain with a consumer woken only by the eventfd while the pusher
+         * keeps waiting for room in the ring */
+        Thread pusher;
+        size_t popped = 0;
+        int efd = eventfd(0, EFD_NONBLOCK);
+        assert(efd >= 0);
+        (*q)->notify = efd;
+
+        thread_create(&pusher, NULL, test_14_pusher, *q);
+        while (popped < NPUSHED) {
+            struct pollfd pfd = { .fd = efd, .events = POLLIN };
+            uint64_t count;
+            assert(poll(&pfd, 1, 1000) == 1);
+            assert(read(efd, &count, sizeof(count)) == sizeof(count));
+
+            for (Request *r = queue_try_pop_all(*q); r; r = r->next)
+                assert(r == &PUSHED[popped++]);
+        }
+        thread_join(pusher, NULL);
+
+        assert(queue_try_pop_all(*q) == NULL && (*q)->size == 0);
+        close(efd);
+        queue_delete(*q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -95,6 +390,17 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test queue_push\n");
         fprintf(stderr, "    2. Test queue_pop\n");
         fprintf(stderr, "    3. Test queue_delete\n");
+        fprintf(stderr, "    4. Test queue_create_ring\n");
+        fprintf(stderr, "    5. Test queue_push/pop (ring)\n");
+        fprintf(stderr, "    6. Test queue_push_all\n");
+        fprintf(stderr, "    7. Test queue_try_pop\n");
+        fprintf(stderr, "    8. Test queue_pop_batch\n");
+        fprintf(stderr, "    9. Test queue_pop_all\n");
+        fprintf(stderr, "   10. Test queue_pop_timed\n");
+        fprintf(stderr, "   11. Test queue_create_bounded (fail)\n");
+        fprintf(stderr, "   12. Test queue_create_bounded (drop oldest)\n");
+        fprintf(stderr, "   13. Test queue_create_bounded (block)\n");
+        fprintf(stderr, "   14. Test queue_try_pop_all\n");
         return EXIT_FAILURE;
     }
 
@@ -106,6 +412,17 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_queue_push(); break;
         case 2:  status = test_02_queue_pop(); break;
         case 3:  status = test_03_queue_delete(); break;
+        case 4:  status = test_04_queue_create_ring(); break;
+        case 5:  status = test_05_queue_ring(); break;
+        case 6:  status = test_06_queue_push_all(); break;
+        case 7:  status = test_07_queue_try_pop(); break;
+        case 8:  status = test_08_queue_pop_batch(); break;
+        case 9:  status = test_09_queue_pop_all(); break;
+        case 10: status = test_10_queue_pop_timed(); break;
+        case 11: status = test_11_queue_bounded_fail(); break;
+        case 12: status = test_12_queue_bounded_drop_oldest(); break;
+        case 13: status = test_13_queue_bounded_block(); break;
+        case 14: status = test_14_queue_try_pop_all(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 /* Constants */
@@ -28,14 +29,19 @@ int test_00_request_create() {
 
         if (n->body) {
             assert(streq(n->body, r->body));
+            assert(n->length == strlen(r->body));
         } else {
             assert(n->body == r->body);
+            assert(n->length == 0);
         }
 
-        free(n->method);
-        free(n->uri);
-        free(n->body);
-        free(n);
+        /* Strings are stored inline in the same allocation */
+        char *storage = (char *)(n + 1);
+        assert(n->method == storage);
+        assert(n->uri    == storage + strlen(r->method) + 1);
+        assert(n->uri + strlen(r->uri) < storage + n->capacity);
+
+        request_delete(n);
     }
 
     return EXIT_SUCCESS;
@@ -172,6 +178,113 @@ failure:
     return status;
 }
 
+int test_04_request_pool() {
+    /* Deleted requests are recycled by the next request of the same size */
+    Request *a = request_create("PUT", "/topic/HOT", "SOME LIKE IT");
+    assert(a);
+    request_delete(a);
+
+    Request *b = request_create("GET", "/queue/LIVE", "FOREVER");
+    assert(b == a);
+    assert(streq(b->body, "FOREVER"));
+
+    /* Large bodies bypass the pool */
+    size_t length = 1<<16;
+    char  *body   = malloc(length);
+    memset(body, 'x', length);
+
+    Request *c = request_create_body("PUT", "/topic/BIG", body, length);
+    assert(c);
+    assert(c->length == length);
+    assert(c->body[length] == 0);
+    assert(memcmp(c->body, body, length) == 0);
+
+    free(body);
+    request_delete(b);
+    request_delete(c);
+    return EXIT_SUCCESS;
+}
+
+int test_05_request_send() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Request *requests[] = {
+        request_create(REQUESTS[0].method, REQUESTS[0].uri, REQUESTS[0].body),
+        request_create(REQUESTS[2].method, REQUESTS[2].uri, REQUESTS[2].body),
+    };
+    Buffer headers;
+    buffer_init(&headers);
+
+    assert(request_send(requests, 2, &headers, fds[0]));
+    close(fds[0]);
+
+    char *target =
+        "PUT /topic/HOT HTTP/1.0\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 12\r\n"
+        "\r\n"
+        "SOME LIKE IT"
+        "DELETE /subscription/LIVE/FOREVER HTTP/1.0\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    char buffer[BUFSIZ];
+    size_t length = 0;
+    ssize_t n;
+    while ((n = read(fds[1], buffer + length, BUFSIZ - 1 - length)) > 0)
+        length += n;
+    buffer[length] = 0;
+    close(fds[1]);
+
+    int status = streq(buffer, target) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (status != EXIT_SUCCESS)
+        fprintf(stderr, "%s != %s\n", buffer, target);
+
+    buffer_free(&headers);
+    request_delete(requests[0]);
+    request_delete(requests[1]);
+    return status;
+}
+
+int test_06_request_prefix() {
+    size_t plength;
+    char *prefix = request_prefix(REQUESTS[0].method, REQUESTS[0].uri, &plength);
+    assert(prefix);
+    assert(streq(prefix, "PUT /topic/HOT HTTP/1.0\r\nConnection: keep-alive\r\nContent-Length: "));
+    assert(plength == strlen(prefix));
+
+    Request *formatted = request_create("PUT", REQUESTS[0].uri, REQUESTS[0].body);
+    Request *prefixed  = request_create("PUT", NULL, REQUESTS[0].body);
+    prefixed->uri     = REQUESTS[0].uri;
+    prefixed->prefix  = prefix;
+    prefixed->plength = plength;
+
+    Buffer a, b;
+    buffer_init(&a);
+    buffer_init(&b);
+
+    /* Persistent headers match, while other headers ignore the prefix */
+    for (int persistent = 0; persistent < 2; persistent++) {
+        buffer_consume(&a, buffer_length(&a));
+        buffer_consume(&b, buffer_length(&b));
+        assert(request_format(formatted, &a, persistent));
+        assert(request_format(prefixed,  &b, persistent));
+        assert(buffer_length(&a) == buffer_length(&b));
+        assert(memcmp(buffer_head(&a), buffer_head(&b), buffer_length(&a)) == 0);
+    }
+
+    buffer_free(&a);
+    buffer_free(&b);
+    request_delete(formatted);
+    request_delete(prefixed);
+    free(prefix);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -182,6 +295,9 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test request_delete\n");
         fprintf(stderr, "    2. Test request_write (w/ body)\n");
         fprintf(stderr, "    3. Test request_write (w/out body)\n");
+        fprintf(stderr, "    4. Test request pool\n");
+        fprintf(stderr, "    5. Test request_send\n");
+        fprintf(stderr, "    6. Test request_prefix\n");
         return EXIT_FAILURE;
     }
 
@@ -193,6 +309,9 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_request_delete(); break;
         case 2:  status = test_02_request_write(); break;
         case 3:  status = test_03_request_write(); break;
+        case 4:  status = test_04_request_pool(); break;
+        case 5:  status = test_05_request_send(); break;
+        case 6:  status = test_06_request_prefix(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -0,0 +1,137 @@
+/* test_stop_client.c: Message Queue Stop test */
+
+#include "mq/client.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC     = "stopping";
+const size_t NMESSAGES  = 20000;
+const size_t NBATCH     = 64;
+const size_t NROUND     = 200;	// Messages published and then retrieved per round (divides NMESSAGES)
+const size_t NPREFETCH  = 16;	// Prefetch window (larger than the ring)
+const size_t NTHREADS   = 8;	// Publishers racing to fill outgoing (divides NMESSAGES)
+const size_t NRING      = 4;	// Ring capacity (smaller than a pusher batch)
+const unsigned TIMEOUT = 60;	// Seconds before a stall or lost message fails the test
+
+/* Globals */
+
+size_t Acked    = 0;	// Asynchronous publishes acknowledged with 200
+size_t Rejected = 0;	// Asynchronous publishes acknowledged with anything else
+
+/* Functions */
+
+void ack_handler(MessageQueue *mq, const MessageQueueAck *acks, size_t n, void *arg) {
+    for (size_t a = 0; a < n; a++)
+    	__atomic_fetch_add(acks[a].status == 200 ? &Acked : &Rejected, 1, __ATOMIC_RELAXED);
+}
+
+void *publisher(void *arg) {
+    MessageQueue *mq = (MessageQueue *)arg;
+    char body[BUFSIZ];
+
+    for (size_t i = 0; i < NMESSAGES / NTHREADS; i++) {
+    	sprintf(body, "%lu. Stopping\n", i);
+    	assert(mq_publish_async(mq, TOPIC, body) > 0);
+    }
+    return NULL;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+    char  name[BUFSIZ];
+    MessageQueueOptions options = {
+    	.ack_handler = ack_handler,
+    };
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+    if (argc > 3) { options.reactor = strstr(argv[3], "reactor") != NULL; }
+    if (argc > 3) { options.connections = strstr(argv[3], "pool") ? 2 : 0; }
+    if (argc > 3) { options.ring_capacity = strstr(argv[3], "ring") ? NRING : 0; }
+    size_t prefetch = argc > 3 && strstr(argv[3], "prefetch") ? NPREFETCH : 0;
+    snprintf(name, BUFSIZ, "%s.%d", getenv("USER") ? getenv("USER") : "stop_client_test", getpid());
+
+    /* Evicted publishes are never answered, so they cannot be acknowledged */
+    MessageQueueOptions dropping = options;
+    dropping.max_outgoing    = 4;
+    dropping.outgoing_policy = QUEUE_DROP_OLDEST;
+    assert(!mq_create_with_options(name, host, port, &dropping));
+
+    /* Publish from several threads and stop right away */
+    alarm(TIMEOUT);
+
+    MessageQueue *mq = mq_create_with_options(name, host, port, &options);
+    assert(mq);
+
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+
+    MessageQueueStats stats;
+    do {
+    	usleep(1000);
+    	mq_stats(mq, &stats);
+    } while (stats.responses[MQ_REQUEST_SUBSCRIPTION] < 1);
+
+    Thread publishers[NTHREADS];
+    for (size_t t = 0; t < NTHREADS; t++)
+    	thread_create(&publishers[t], NULL, publisher, mq);
+    for (size_t t = 0; t < NTHREADS; t++)
+    	thread_join(publishers[t], NULL);
+    mq_stop(mq);
+
+    /* Every publish was answered before mq_stop returned */
+    mq_stats(mq, &stats);
+    assert(stats.responses[MQ_REQUEST_PUBLISH] == NMESSAGES);
+    assert(Acked == NMESSAGES && Rejected == 0);
+    mq_delete(mq);
+
+    /* Check what the broker stored, while publishing and retrieving in
+     * rounds from one thread */
+    MessageQueueOptions retrieving = options;
+    retrieving.prefetch = prefetch;
+
+    mq = mq_create_with_options(name, host, port, &retrieving);
+    assert(mq);
+    mq_start(mq);
+
+    char  body[BUFSIZ];
+    char *batch[NBATCH];
+    size_t messages  = 0;
+    size_t published = 0;
+    while (messages < NMESSAGES + published) {
+    	if (published < NMESSAGES) {
+    	    for (size_t i = 0; i < NROUND; i++) {
+    	    	sprintf(body, "%lu. Stopping again\n", published + i);
+    	    	assert(mq_publish(mq, TOPIC, body));
+	    }
+	    published += NROUND;
+	}
+
+	for (size_t round = 0; round < NROUND && messages < NMESSAGES + published; ) {
+	    size_t n = mq_retrieve_many(mq, NBATCH, batch);
+	    for (size_t m = 0; m < n; m++) {
+	    	assert(strstr(batch[m], "Stopping"));
+	    	free(batch[m]);
+	    }
+	    messages += n;
+	    round    += n;
+	}
+    }
+
+    mq_unsubscribe(mq, TOPIC);
+    mq_stop(mq);
+    mq_delete(mq);
+
+    assert(messages == NMESSAGES + published);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */